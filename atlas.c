@@ -0,0 +1,151 @@
+/*
+ * Implementation of packing images into a texture atlas
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "atlas.h"
+
+// placement of one image in the atlas
+struct AtlasItem {
+  struct Image *img;
+  uint32_t width, height;   // rounded up to the alignment
+  uint32_t x, y;
+};
+
+/*
+ * orders atlas items by decreasing height (then decreasing width),
+ * so that the images on each shelf have similar heights
+ */
+static int compare_items(const void *a, const void *b) {
+  const struct AtlasItem *item_a = (const struct AtlasItem *) a;
+  const struct AtlasItem *item_b = (const struct AtlasItem *) b;
+  if (item_a->height != item_b->height) {
+    return (item_a->height > item_b->height) ? -1 : 1;
+  }
+  if (item_a->width != item_b->width) {
+    return (item_a->width > item_b->width) ? -1 : 1;
+  }
+  return 0;
+}
+
+/*
+ * rounds a size up to a multiple of align (a power of 2)
+ */
+static uint64_t align_up(uint64_t val, uint32_t align) {
+  return (val + align - 1) & ~(uint64_t) (align - 1);
+}
+
+/*
+ * computes the smallest integer whose square is at least val
+ */
+static uint64_t sqrt_ceil(uint64_t val) {
+  uint64_t lo = 0, hi = 1U << 31;
+  while (lo < hi) {
+    uint64_t mid = (lo + hi) / 2;
+    if (mid * mid < val) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+ * copies every pixel of src to dst, which must have the same size
+ * and flags, and start at the same offset within a block
+ */
+static void copy_pixels(struct Image *dst, const struct Image *src) {
+  for (uint32_t y = 0; y < src->height; y++) {
+    uint32_t n;
+    for (uint32_t x = 0; x < src->width; x += n) {
+      n = image_contiguous_pixels(src, x, src->width - x);
+      memcpy(dst->data + image_pixel_index(dst, x, y),
+             src->data + image_pixel_index(src, x, y), n * sizeof(uint32_t));
+    }
+  }
+}
+
+int atlas_pack(struct Image *atlas, struct Image *images[], uint32_t num_images) {
+  uint32_t flags = get_new_image_flags();
+  uint32_t align = (flags & IMG_TILED) ? IMG_BLOCK_SIZE : 1;
+
+  struct AtlasItem *items = (struct AtlasItem *) malloc((num_images + 1) * sizeof(struct AtlasItem));
+  if (items == NULL) {
+    return -1;
+  }
+  uint32_t num_items = 0;
+  uint64_t area = 0, max_width = 1;
+  for (uint32_t i = 0; i < num_images; i++) {
+    struct Image *img = images[i];
+    if (img == NULL || img->data == NULL) {
+      continue;
+    }
+    if (img->flags != flags) {
+      free(items);
+      return -1;
+    }
+    items[num_items].img = img;
+    items[num_items].width = (uint32_t) align_up(img->width, align);
+    items[num_items].height = (uint32_t) align_up(img->height, align);
+    area += (uint64_t) items[num_items].width * items[num_items].height;
+    if (items[num_items].width > max_width) {
+      max_width = items[num_items].width;
+    }
+    num_items++;
+  }
+  qsort(items, num_items, sizeof(struct AtlasItem), compare_items);
+
+  // aim for a square atlas, but make it at least as wide as the
+  // widest image
+  uint64_t atlas_width = align_up(sqrt_ceil(area), align);
+  if (atlas_width < max_width) {
+    atlas_width = max_width;
+  }
+
+  // place the images on shelves from left to right
+  uint64_t shelf_y = 0, shelf_height = 0, shelf_x = 0;
+  for (uint32_t i = 0; i < num_items; i++) {
+    if (shelf_x + items[i].width > atlas_width) {
+      shelf_y += shelf_height;
+      shelf_x = 0;
+      shelf_height = 0;
+    }
+    if (shelf_height == 0) {
+      shelf_height = items[i].height;
+    }
+    items[i].x = (uint32_t) shelf_x;
+    items[i].y = (uint32_t) shelf_y;
+    shelf_x += items[i].width;
+  }
+  uint64_t atlas_height = shelf_y + shelf_height;
+  if (atlas_height == 0) {
+    atlas_height = 1;
+  }
+  if (atlas_width > UINT32_MAX || atlas_height > UINT32_MAX) {
+    free(items);
+    return -1;
+  }
+
+  struct Image result;
+  if (init_image(&result, (uint32_t) atlas_width, (uint32_t) atlas_height) != IMG_SUCCESS) {
+    free(items);
+    return -1;
+  }
+  for (uint32_t i = 0; i < num_items; i++) {
+    struct Image *img = items[i].img;
+    struct Image view;
+    // can't fail, since every item is within the atlas and aligned
+    image_view(&view, &result, items[i].x, items[i].y, img->width, img->height);
+    copy_pixels(&view, img);
+    *img = view;
+  }
+
+  free(items);
+  *atlas = result;
+  return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Header file for packing images into a texture atlas
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <stdint.h>
+#include "image.h"
+
+// Tilemaps and spritemaps loaded from separate files each have their
+// own pixel buffer. Packing them into one atlas image puts all of
+// their pixels in a single contiguous allocation, and replaces each
+// image by a view (see image_view) of its region of the atlas. Since
+// a view has the same width and height as the original image, source
+// rectangles given to draw_tile and draw_sprite don't need to change.
+
+// Pack images into a new atlas image. The images are placed on
+// shelves (rows of images sorted by height), and for tiled images
+// every image starts at a block boundary.
+//
+// Parameters:
+//   atlas      - pointer to a struct Image which is initialized as the
+//                atlas (owning a new pixel buffer)
+//   images     - array of pointers to the images to pack; NULL entries
+//                and images without pixel data are skipped. Every image
+//                must have the flags given by get_new_image_flags().
+//                Each packed image is replaced by a view of the atlas,
+//                but its previous pixel buffer is not freed.
+//   num_images - number of elements in images
+//
+// Returns:
+//   0 if successful, -1 if the images have different flags or memory
+//   could not be allocated (in which case the images are unchanged)
+int atlas_pack(struct Image *atlas, struct Image *images[], uint32_t num_images);
+
+#endif // ATLAS_H
@@ -0,0 +1,284 @@
+/*
+ * Benchmark program for drawing functions
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "image.h"
+#include "drawing_funcs.h"
+#include "blend_kernels.h"
+#include "sprite_runs.h"
+
+// Each configuration (primitive, size, alpha class and clipping case)
+// is warmed up while choosing a number of calls that takes at least
+// the trial time, then timed over several trials of that many calls.
+// The median trial is reported as one CSV row on stdout. Every call
+// of a configuration draws at the same position, so the results
+// measure the drawing work with the canvas pixels in cache.
+
+// default canvas size, trial time and number of trials
+#define DEFAULT_CANVAS    1024
+#define DEFAULT_TRIAL_NS  5000000LL
+#define DEFAULT_TRIALS    5
+
+#define MAX_TRIALS        101
+
+// size of the tilemap/spritemap the tiles and sprites come from
+#define SOURCE_SIZE       256
+
+// primitive sizes (the width and height of rectangles, tiles and
+// sprites, and the diameter of circles)
+static const int32_t shape_sizes[] = { 4, 16, 64, 256 };
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+enum Primitive { PRIM_RECT, PRIM_CIRCLE, PRIM_TILE, PRIM_SPRITE, NUM_PRIMS };
+static const char *prim_names[] = { "rect", "circle", "tile", "sprite" };
+
+// alpha classes: the alpha of the color (rectangles and circles) or
+// of every source pixel (tiles and sprites)
+static const char *alpha_names[] = { "opaque", "translucent", "transparent" };
+static const uint32_t alpha_values[] = { 0xFF, 0x80, 0x00 };
+
+// clipping cases: entirely within the canvas, hanging off its left
+// edge by half, and entirely off the canvas
+enum Clip { CLIP_INSIDE, CLIP_PARTIAL, CLIP_OUTSIDE, NUM_CLIPS };
+static const char *clip_names[] = { "inside", "partial", "outside" };
+
+struct BenchConfig {
+  struct Image *canvas;
+  struct Image *source;
+  enum Primitive prim;
+  int32_t size;
+  uint32_t color;
+  int32_t x, y;            // upper left corner of the primitive
+  struct Rect src_rect;    // tile/sprite source region
+};
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// read the CPU's time stamp counter (0 where there isn't one)
+static uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// draw one instance of the configuration's primitive
+static void draw_once(const struct BenchConfig *cfg) {
+  int32_t r = cfg->size / 2;
+  struct Rect rect = { .x = cfg->x, .y = cfg->y, .width = cfg->size, .height = cfg->size };
+  switch (cfg->prim) {
+  case PRIM_RECT:
+    draw_rect(cfg->canvas, &rect, cfg->color);
+    break;
+  case PRIM_CIRCLE:
+    draw_circle(cfg->canvas, cfg->x + r, cfg->y + r, r, cfg->color);
+    break;
+  case PRIM_TILE:
+    draw_tile(cfg->canvas, cfg->x, cfg->y, cfg->source, &cfg->src_rect);
+    break;
+  case PRIM_SPRITE:
+    draw_sprite(cfg->canvas, cfg->x, cfg->y, cfg->source, &cfg->src_rect);
+    break;
+  default:
+    break;
+  }
+}
+
+// count the canvas pixels one call of the configuration draws
+static int64_t visible_pixels(const struct BenchConfig *cfg) {
+  int64_t count = 0;
+  if (cfg->prim == PRIM_CIRCLE) {
+    // each row of the circle is a span of 2*half_width+1 pixels,
+    // as draw_circle fills it (which reaches row and column x+2r)
+    int64_t r = cfg->size / 2, cx = (int64_t) cfg->x + r, cy = (int64_t) cfg->y + r;
+    for (int64_t j = cy - r; j <= cy + r; j++) {
+      if (j < 0 || j >= cfg->canvas->height) {
+        continue;
+      }
+      int64_t half_width = isqrt(square(r) - square(j - cy));
+      int64_t min_x = (cx - half_width < 0) ? 0 : cx - half_width;
+      int64_t max_x = (cx + half_width > (int64_t) cfg->canvas->width - 1) ? (int64_t) cfg->canvas->width - 1 : cx + half_width;
+      if (min_x <= max_x) {
+        count += max_x - min_x + 1;
+      }
+    }
+    return count;
+  }
+  for (int32_t j = cfg->y; j < cfg->y + cfg->size; j++) {
+    for (int32_t i = cfg->x; i < cfg->x + cfg->size; i++) {
+      if (in_bounds(cfg->canvas, i, j) == 0) {
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+// time calls of the configuration's primitive
+static void time_calls(const struct BenchConfig *cfg, int64_t calls, int64_t *ns, uint64_t *cycles) {
+  int64_t start = now_ns();
+  uint64_t start_cycles = read_cycles();
+  for (int64_t i = 0; i < calls; i++) {
+    draw_once(cfg);
+  }
+  *cycles = read_cycles() - start_cycles;
+  *ns = now_ns() - start;
+}
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t val_a = *(const int64_t *) a, val_b = *(const int64_t *) b;
+  return (val_a > val_b) - (val_a < val_b);
+}
+
+static int compare_uint64(const void *a, const void *b) {
+  uint64_t val_a = *(const uint64_t *) a, val_b = *(const uint64_t *) b;
+  return (val_a > val_b) - (val_a < val_b);
+}
+
+// benchmark one configuration and print its CSV row
+static void bench_config(const char *program, const struct BenchConfig *cfg,
+                         const char *alpha_name, const char *clip_name,
+                         int64_t trial_ns, int trials) {
+  // warm up, doubling the number of calls until a trial is long enough
+  int64_t calls = 1, ns;
+  uint64_t cycles;
+  for (;;) {
+    time_calls(cfg, calls, &ns, &cycles);
+    if (ns >= trial_ns || calls >= (1LL << 40)) {
+      break;
+    }
+    calls *= 2;
+  }
+
+  int64_t trial_times[MAX_TRIALS];
+  uint64_t trial_cycles[MAX_TRIALS];
+  for (int t = 0; t < trials; t++) {
+    time_calls(cfg, calls, &trial_times[t], &trial_cycles[t]);
+  }
+  qsort(trial_times, trials, sizeof(int64_t), compare_int64);
+  qsort(trial_cycles, trials, sizeof(uint64_t), compare_uint64);
+
+  double ns_per_call = (double) trial_times[trials / 2] / calls;
+  double cycles_per_call = (double) trial_cycles[trials / 2] / calls;
+  int64_t pixels = visible_pixels(cfg);
+  printf("%s,%s,%s,%u,%d,%s,%s,%lld,%lld,%.2f,",
+         program, get_blend_backend(), prim_names[cfg->prim], cfg->canvas->width,
+         cfg->size, alpha_name, clip_name, (long long) calls, (long long) pixels, ns_per_call);
+  if (pixels > 0) {
+    // per-pixel rates are left empty when nothing is drawn
+    printf("%.4f,%.2f,%.4f\n", ns_per_call / pixels, pixels * 1000.0 / ns_per_call,
+           cycles_per_call / pixels);
+  } else {
+    printf(",,\n");
+  }
+  fflush(stdout);
+}
+
+// fill the tile/spritemap with pixels of one alpha class
+static void fill_source(struct Image *source, uint32_t alpha, uint32_t *state) {
+  for (uint32_t y = 0; y < source->height; y++) {
+    for (uint32_t x = 0; x < source->width; x++) {
+      *state = *state * 1103515245U + 12345U;
+      source->data[image_pixel_index(source, x, y)] = (*state & 0xFFFFFF00U) | alpha;
+    }
+  }
+  invalidate_sprite_runs(source);
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: bench [options]\n"
+                  "Options:\n"
+                  "  --canvas N    canvas width and height (default %d)\n"
+                  "  --trial-ms N  minimum time of each trial in ms (default %lld)\n"
+                  "  --trials N    number of timed trials per configuration (default %d)\n"
+                  "Writes one CSV row per configuration to stdout.\n",
+          DEFAULT_CANVAS, DEFAULT_TRIAL_NS / 1000000, DEFAULT_TRIALS);
+}
+
+int main(int argc, char **argv) {
+  long canvas_size = DEFAULT_CANVAS;
+  long long trial_ns = DEFAULT_TRIAL_NS;
+  long trials = DEFAULT_TRIALS;
+
+  for (int i = 1; i < argc; i++) {
+    char *end = NULL;
+    long val = (i + 1 < argc) ? strtol(argv[i + 1], &end, 10) : 0;
+    if (end == NULL || *end != '\0' || val < 1) {
+      usage();
+      return 1;
+    }
+    if (strcmp(argv[i], "--canvas") == 0 && val <= 65536) {
+      canvas_size = val;
+    } else if (strcmp(argv[i], "--trial-ms") == 0 && val <= 60000) {
+      trial_ns = val * 1000000LL;
+    } else if (strcmp(argv[i], "--trials") == 0 && val <= MAX_TRIALS) {
+      trials = val;
+    } else {
+      usage();
+      return 1;
+    }
+    i++;
+  }
+
+  // the program name identifies the implementation being measured
+  const char *program = strrchr(argv[0], '/');
+  program = (program != NULL) ? program + 1 : argv[0];
+
+  struct Image canvas, source;
+  if (init_image(&canvas, canvas_size, canvas_size) != IMG_SUCCESS
+      || init_image(&source, SOURCE_SIZE, SOURCE_SIZE) != IMG_SUCCESS) {
+    fprintf(stderr, "Error: could not create images\n");
+    return 1;
+  }
+
+  printf("program,blend_backend,primitive,canvas,size,alpha,clip,calls,"
+         "pixels_per_call,ns_per_call,ns_per_pixel,mpixels_per_s,cycles_per_pixel\n");
+  uint32_t state = 1;
+  for (unsigned a = 0; a < ARRAY_LEN(alpha_values); a++) {
+    fill_source(&source, alpha_values[a], &state);
+    for (int p = 0; p < NUM_PRIMS; p++) {
+      for (unsigned s = 0; s < ARRAY_LEN(shape_sizes); s++) {
+        for (int c = 0; c < NUM_CLIPS; c++) {
+          struct BenchConfig cfg = {
+            .canvas = &canvas,
+            .source = &source,
+            .prim = (enum Primitive) p,
+            .size = shape_sizes[s],
+            .color = 0x40A0E000U | alpha_values[a],
+            .src_rect = { .x = 0, .y = 0, .width = shape_sizes[s], .height = shape_sizes[s] },
+          };
+          cfg.y = ((int32_t) canvas.height - cfg.size) / 2;
+          if (c == CLIP_INSIDE) {
+            cfg.x = ((int32_t) canvas.width - cfg.size) / 2;
+          } else if (c == CLIP_PARTIAL) {
+            cfg.x = -cfg.size / 2;
+          } else {
+            cfg.x = -cfg.size - 1;
+          }
+          bench_config(program, &cfg, alpha_names[a], clip_names[c], trial_ns, (int) trials);
+        }
+      }
+    }
+  }
+
+  free(canvas.data);
+  invalidate_sprite_runs(&source);
+  free(source.data);
+  return 0;
+}
@@ -0,0 +1,692 @@
+/*
+ * Implementation of blending kernels used by the drawing functions
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+// The vector kernels work on 16-bit lanes: each 8-bit component is
+// widened, multiplied by alpha or (255-alpha) (the sum is at most
+// 255*255, which fits in 16 bits), and divided by 255 exactly using
+// the identity x/255 == (x + 1 + (x >> 8)) >> 8, which holds for
+// every x in [0, 255*255]. This keeps the results bit-exact with
+// blend_colors without needing a vector integer divide.
+
+#include <stdlib.h>
+#include <string.h>
+#include "blend_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// mask which sets the alpha component of a pixel to 255
+#define ALPHA_MASK 0x000000FFU
+
+/*
+ * blends a single pixel, exactly as blend_colors does
+ *
+ * Parameters:
+ *   fg - uint32_t foreground color
+ *   bg - uint32_t background color
+ *
+ * Returns:
+ *   a uint32_t value that represents the blended color
+ */
+static inline uint32_t blend_pixel(uint32_t fg, uint32_t bg) {
+  uint32_t alpha = fg & 255;
+  uint32_t result = ALPHA_MASK;
+  for (int shift = 8; shift < 32; shift += 8) {
+    uint32_t f = (fg >> shift) & 255;
+    uint32_t b = (bg >> shift) & 255;
+    result |= ((alpha*f + (255 - alpha)*b) / 255) << shift;
+  }
+  return result;
+}
+
+void blend_span_color_scalar(uint32_t *dst, uint32_t color, size_t n) {
+  uint32_t alpha = color & 255;
+  // the foreground terms are the same for every pixel of the span
+  uint32_t fg_r = alpha * ((color >> 24) & 255);
+  uint32_t fg_g = alpha * ((color >> 16) & 255);
+  uint32_t fg_b = alpha * ((color >> 8) & 255);
+  uint32_t inv_alpha = 255 - alpha;
+  for (size_t i = 0; i < n; i++) {
+    uint32_t bg = dst[i];
+    dst[i] = (((fg_r + inv_alpha * ((bg >> 24) & 255)) / 255) << 24)
+           | (((fg_g + inv_alpha * ((bg >> 16) & 255)) / 255) << 16)
+           | (((fg_b + inv_alpha * ((bg >> 8) & 255)) / 255) << 8)
+           | ALPHA_MASK;
+  }
+}
+
+void blend_span_pixels_scalar(uint32_t *dst, const uint32_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = blend_pixel(src[i], dst[i]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Lookup table kernels
+////////////////////////////////////////////////////////////////////////
+
+// products of every alpha value and every component value
+// (256*256 entries), built the first time the LUT backend is selected
+static uint16_t blend_mul_table[256][256];
+static int blend_mul_table_ready;
+
+static void init_blend_mul_table(void) {
+  if (blend_mul_table_ready) {
+    return;
+  }
+  for (uint32_t a = 0; a < 256; a++) {
+    for (uint32_t v = 0; v < 256; v++) {
+      blend_mul_table[a][v] = (uint16_t) (a * v);
+    }
+  }
+  blend_mul_table_ready = 1;
+}
+
+/*
+ * divides a value of at most 255*255 by 255, rounding down
+ */
+static inline uint32_t div255(uint32_t x) {
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+static void blend_span_color_lut(uint32_t *dst, uint32_t color, size_t n) {
+  uint32_t alpha = color & 255;
+  const uint16_t *fg_row = blend_mul_table[alpha];
+  const uint16_t *bg_row = blend_mul_table[255 - alpha];
+  // the foreground terms are the same for every pixel of the span
+  uint32_t fg_r = fg_row[(color >> 24) & 255];
+  uint32_t fg_g = fg_row[(color >> 16) & 255];
+  uint32_t fg_b = fg_row[(color >> 8) & 255];
+  for (size_t i = 0; i < n; i++) {
+    uint32_t bg = dst[i];
+    dst[i] = (div255(fg_r + bg_row[(bg >> 24) & 255]) << 24)
+           | (div255(fg_g + bg_row[(bg >> 16) & 255]) << 16)
+           | (div255(fg_b + bg_row[(bg >> 8) & 255]) << 8)
+           | ALPHA_MASK;
+  }
+}
+
+static void blend_span_pixels_lut(uint32_t *dst, const uint32_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t fg = src[i], bg = dst[i];
+    const uint16_t *fg_row = blend_mul_table[fg & 255];
+    const uint16_t *bg_row = blend_mul_table[255 - (fg & 255)];
+    dst[i] = (div255(fg_row[(fg >> 24) & 255] + bg_row[(bg >> 24) & 255]) << 24)
+           | (div255(fg_row[(fg >> 16) & 255] + bg_row[(bg >> 16) & 255]) << 16)
+           | (div255(fg_row[(fg >> 8) & 255] + bg_row[(bg >> 8) & 255]) << 8)
+           | ALPHA_MASK;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Premultiplied alpha kernels
+////////////////////////////////////////////////////////////////////////
+
+// With premultiplied alpha, compositing a foreground pixel P over a
+// background pixel D is P + D*(255-alpha)/255 for all four components
+// (including alpha), so there is only one multiply per component.
+
+uint32_t premultiply_color(uint32_t color) {
+  uint32_t alpha = color & 255;
+  uint32_t result = alpha;
+  for (int shift = 8; shift < 32; shift += 8) {
+    result |= ((((color >> shift) & 255) * alpha + 127) / 255) << shift;
+  }
+  return result;
+}
+
+uint32_t unpremultiply_color(uint32_t color) {
+  uint32_t alpha = color & 255;
+  if (alpha == 0) {
+    return 0;
+  }
+  uint32_t result = alpha;
+  for (int shift = 8; shift < 32; shift += 8) {
+    uint32_t c = (((color >> shift) & 255) * 255 + alpha / 2) / alpha;
+    result |= ((c > 255) ? 255 : c) << shift;
+  }
+  return result;
+}
+
+void premultiply_span(uint32_t *dst, const uint32_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t alpha = src[i] & 255;
+    dst[i] = (alpha == 255) ? src[i] : premultiply_color(src[i]);
+  }
+}
+
+void unpremultiply_span(uint32_t *dst, const uint32_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t alpha = src[i] & 255;
+    dst[i] = (alpha == 255) ? src[i] : unpremultiply_color(src[i]);
+  }
+}
+
+/*
+ * composites a premultiplied foreground pixel over a background pixel,
+ * saturating each component at 255 like the vector kernels do (which
+ * only matters if the foreground is not validly premultiplied)
+ */
+static inline uint32_t blend_pixel_premultiplied(uint32_t fg, uint32_t bg, uint32_t inv_alpha) {
+  uint32_t result = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t c = ((fg >> shift) & 255) + (((bg >> shift) & 255) * inv_alpha) / 255;
+    result |= ((c > 255) ? 255 : c) << shift;
+  }
+  return result;
+}
+
+static void blend_span_color_premultiplied_scalar(uint32_t *dst, uint32_t color, size_t n) {
+  uint32_t inv_alpha = 255 - (color & 255);
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = blend_pixel_premultiplied(color, dst[i], inv_alpha);
+  }
+}
+
+static void blend_span_pixels_premultiplied_scalar(uint32_t *dst, const uint32_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = blend_pixel_premultiplied(src[i], dst[i], 255 - (src[i] & 255));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Sample conversion kernels
+////////////////////////////////////////////////////////////////////////
+
+// PNG rows store the components of each pixel as bytes in R, G, B(, A)
+// order, so on a little-endian CPU converting between RGBA samples and
+// pixels reverses the bytes of each pixel, and expanding RGB samples
+// also inserts an alpha byte of 255. The vector versions do this with
+// byte shuffles.
+
+static void rgb_to_pixels_scalar(uint32_t *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t *p = src + 3 * i;
+    dst[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | ALPHA_MASK;
+  }
+}
+
+static void rgba_to_pixels_scalar(uint32_t *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t *p = src + 4 * i;
+    dst[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+  }
+}
+
+static void pixels_to_rgba_scalar(uint8_t *dst, const uint32_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t pixel = src[i];
+    uint8_t *p = dst + 4 * i;
+    p[0] = (uint8_t) (pixel >> 24);
+    p[1] = (uint8_t) (pixel >> 16);
+    p[2] = (uint8_t) (pixel >> 8);
+    p[3] = (uint8_t) pixel;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+////////////////////////////////////////////////////////////////////////
+// SSE2 kernels (4 pixels per iteration)
+////////////////////////////////////////////////////////////////////////
+
+/*
+ * divides each 16-bit lane (each at most 255*255) by 255, rounding down
+ */
+__attribute__((target("sse2")))
+static inline __m128i div255_epu16(__m128i x) {
+  __m128i t = _mm_add_epi16(x, _mm_set1_epi16(1));
+  t = _mm_add_epi16(t, _mm_srli_epi16(x, 8));
+  return _mm_srli_epi16(t, 8);
+}
+
+/*
+ * blends two pixels widened to 16-bit lanes, given the foreground
+ * term (alpha*fg) and the background weight (255-alpha) for each lane
+ */
+__attribute__((target("sse2")))
+static inline __m128i blend_epu16(__m128i fg_term, __m128i bg, __m128i inv_alpha) {
+  return div255_epu16(_mm_add_epi16(fg_term, _mm_mullo_epi16(bg, inv_alpha)));
+}
+
+__attribute__((target("sse2")))
+void blend_span_color_sse2(uint32_t *dst, uint32_t color, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha_mask = _mm_set1_epi32(ALPHA_MASK);
+  __m128i fg = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+  __m128i alpha = _mm_set1_epi16(color & 255);
+  __m128i inv_alpha = _mm_set1_epi16(255 - (color & 255));
+  // the foreground term is the same for every pixel of the span
+  __m128i fg_term = _mm_mullo_epi16(fg, alpha);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i bg = _mm_loadu_si128((const __m128i *) (dst + i));
+    __m128i lo = blend_epu16(fg_term, _mm_unpacklo_epi8(bg, zero), inv_alpha);
+    __m128i hi = blend_epu16(fg_term, _mm_unpackhi_epi8(bg, zero), inv_alpha);
+    __m128i result = _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_mask);
+    _mm_storeu_si128((__m128i *) (dst + i), result);
+  }
+  blend_span_color_scalar(dst + i, color, n - i);
+}
+
+/*
+ * blends two foreground pixels over two background pixels,
+ * all widened to 16-bit lanes
+ */
+__attribute__((target("sse2")))
+static inline __m128i blend_pixels_epu16(__m128i fg, __m128i bg) {
+  // alpha is the lowest lane of each pixel; broadcast it to all four lanes
+  __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(fg, 0), 0);
+  __m128i inv_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+  return blend_epu16(_mm_mullo_epi16(fg, alpha), bg, inv_alpha);
+}
+
+__attribute__((target("sse2")))
+void blend_span_pixels_sse2(uint32_t *dst, const uint32_t *src, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha_mask = _mm_set1_epi32(ALPHA_MASK);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i fg = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i bg = _mm_loadu_si128((const __m128i *) (dst + i));
+    __m128i lo = blend_pixels_epu16(_mm_unpacklo_epi8(fg, zero), _mm_unpacklo_epi8(bg, zero));
+    __m128i hi = blend_pixels_epu16(_mm_unpackhi_epi8(fg, zero), _mm_unpackhi_epi8(bg, zero));
+    __m128i result = _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_mask);
+    _mm_storeu_si128((__m128i *) (dst + i), result);
+  }
+  blend_span_pixels_scalar(dst + i, src + i, n - i);
+}
+
+/*
+ * premultiplied blend of two pixels widened to 16-bit lanes
+ */
+__attribute__((target("sse2")))
+static inline __m128i blend_premultiplied_epu16(__m128i fg, __m128i bg, __m128i inv_alpha) {
+  return _mm_add_epi16(fg, div255_epu16(_mm_mullo_epi16(bg, inv_alpha)));
+}
+
+__attribute__((target("sse2")))
+static void blend_span_color_premultiplied_sse2(uint32_t *dst, uint32_t color, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i fg = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+  __m128i inv_alpha = _mm_set1_epi16(255 - (color & 255));
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i bg = _mm_loadu_si128((const __m128i *) (dst + i));
+    __m128i lo = blend_premultiplied_epu16(fg, _mm_unpacklo_epi8(bg, zero), inv_alpha);
+    __m128i hi = blend_premultiplied_epu16(fg, _mm_unpackhi_epi8(bg, zero), inv_alpha);
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+  }
+  blend_span_color_premultiplied_scalar(dst + i, color, n - i);
+}
+
+__attribute__((target("sse2")))
+static void blend_span_pixels_premultiplied_sse2(uint32_t *dst, const uint32_t *src, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i max = _mm_set1_epi16(255);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i fg = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i bg = _mm_loadu_si128((const __m128i *) (dst + i));
+    __m128i fg_lo = _mm_unpacklo_epi8(fg, zero);
+    __m128i fg_hi = _mm_unpackhi_epi8(fg, zero);
+    __m128i inv_lo = _mm_sub_epi16(max, _mm_shufflehi_epi16(_mm_shufflelo_epi16(fg_lo, 0), 0));
+    __m128i inv_hi = _mm_sub_epi16(max, _mm_shufflehi_epi16(_mm_shufflelo_epi16(fg_hi, 0), 0));
+    __m128i lo = blend_premultiplied_epu16(fg_lo, _mm_unpacklo_epi8(bg, zero), inv_lo);
+    __m128i hi = blend_premultiplied_epu16(fg_hi, _mm_unpackhi_epi8(bg, zero), inv_hi);
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+  }
+  blend_span_pixels_premultiplied_scalar(dst + i, src + i, n - i);
+}
+
+/*
+ * reverses the bytes of each 32-bit lane (SSE2 has no byte shuffle,
+ * so the bytes of each 16-bit lane are swapped, then the lanes)
+ */
+__attribute__((target("sse2")))
+static inline __m128i byteswap_epi32(__m128i x) {
+  x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+  x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+  return _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+__attribute__((target("sse2")))
+static void rgba_to_pixels_sse2(uint32_t *dst, const uint8_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i samples = _mm_loadu_si128((const __m128i *) (src + 4 * i));
+    _mm_storeu_si128((__m128i *) (dst + i), byteswap_epi32(samples));
+  }
+  rgba_to_pixels_scalar(dst + i, src + 4 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void pixels_to_rgba_sse2(uint8_t *dst, const uint32_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *) (src + i));
+    _mm_storeu_si128((__m128i *) (dst + 4 * i), byteswap_epi32(pixels));
+  }
+  pixels_to_rgba_scalar(dst + 4 * i, src + i, n - i);
+}
+
+////////////////////////////////////////////////////////////////////////
+// AVX2 kernels (8 pixels per iteration)
+////////////////////////////////////////////////////////////////////////
+
+// The AVX2 unpack and pack instructions operate within each 128-bit
+// lane, so unpacking low/high halves and packing them back together
+// preserves pixel order just as in the SSE2 kernels.
+
+__attribute__((target("avx2")))
+static inline __m256i div255_epu16_avx2(__m256i x) {
+  __m256i t = _mm256_add_epi16(x, _mm256_set1_epi16(1));
+  t = _mm256_add_epi16(t, _mm256_srli_epi16(x, 8));
+  return _mm256_srli_epi16(t, 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend_epu16_avx2(__m256i fg_term, __m256i bg, __m256i inv_alpha) {
+  return div255_epu16_avx2(_mm256_add_epi16(fg_term, _mm256_mullo_epi16(bg, inv_alpha)));
+}
+
+__attribute__((target("avx2")))
+void blend_span_color_avx2(uint32_t *dst, uint32_t color, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha_mask = _mm256_set1_epi32(ALPHA_MASK);
+  __m256i fg = _mm256_unpacklo_epi8(_mm256_set1_epi32(color), zero);
+  __m256i alpha = _mm256_set1_epi16(color & 255);
+  __m256i inv_alpha = _mm256_set1_epi16(255 - (color & 255));
+  __m256i fg_term = _mm256_mullo_epi16(fg, alpha);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i bg = _mm256_loadu_si256((const __m256i *) (dst + i));
+    __m256i lo = blend_epu16_avx2(fg_term, _mm256_unpacklo_epi8(bg, zero), inv_alpha);
+    __m256i hi = blend_epu16_avx2(fg_term, _mm256_unpackhi_epi8(bg, zero), inv_alpha);
+    __m256i result = _mm256_or_si256(_mm256_packus_epi16(lo, hi), alpha_mask);
+    _mm256_storeu_si256((__m256i *) (dst + i), result);
+  }
+  blend_span_color_sse2(dst + i, color, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend_pixels_epu16_avx2(__m256i fg, __m256i bg) {
+  __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(fg, 0), 0);
+  __m256i inv_alpha = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+  return blend_epu16_avx2(_mm256_mullo_epi16(fg, alpha), bg, inv_alpha);
+}
+
+__attribute__((target("avx2")))
+void blend_span_pixels_avx2(uint32_t *dst, const uint32_t *src, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha_mask = _mm256_set1_epi32(ALPHA_MASK);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i fg = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i bg = _mm256_loadu_si256((const __m256i *) (dst + i));
+    __m256i lo = blend_pixels_epu16_avx2(_mm256_unpacklo_epi8(fg, zero), _mm256_unpacklo_epi8(bg, zero));
+    __m256i hi = blend_pixels_epu16_avx2(_mm256_unpackhi_epi8(fg, zero), _mm256_unpackhi_epi8(bg, zero));
+    __m256i result = _mm256_or_si256(_mm256_packus_epi16(lo, hi), alpha_mask);
+    _mm256_storeu_si256((__m256i *) (dst + i), result);
+  }
+  blend_span_pixels_sse2(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend_premultiplied_epu16_avx2(__m256i fg, __m256i bg, __m256i inv_alpha) {
+  return _mm256_add_epi16(fg, div255_epu16_avx2(_mm256_mullo_epi16(bg, inv_alpha)));
+}
+
+__attribute__((target("avx2")))
+static void blend_span_color_premultiplied_avx2(uint32_t *dst, uint32_t color, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i fg = _mm256_unpacklo_epi8(_mm256_set1_epi32(color), zero);
+  __m256i inv_alpha = _mm256_set1_epi16(255 - (color & 255));
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i bg = _mm256_loadu_si256((const __m256i *) (dst + i));
+    __m256i lo = blend_premultiplied_epu16_avx2(fg, _mm256_unpacklo_epi8(bg, zero), inv_alpha);
+    __m256i hi = blend_premultiplied_epu16_avx2(fg, _mm256_unpackhi_epi8(bg, zero), inv_alpha);
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_packus_epi16(lo, hi));
+  }
+  blend_span_color_premultiplied_sse2(dst + i, color, n - i);
+}
+
+__attribute__((target("avx2")))
+static void blend_span_pixels_premultiplied_avx2(uint32_t *dst, const uint32_t *src, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i max = _mm256_set1_epi16(255);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i fg = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i bg = _mm256_loadu_si256((const __m256i *) (dst + i));
+    __m256i fg_lo = _mm256_unpacklo_epi8(fg, zero);
+    __m256i fg_hi = _mm256_unpackhi_epi8(fg, zero);
+    __m256i inv_lo = _mm256_sub_epi16(max, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(fg_lo, 0), 0));
+    __m256i inv_hi = _mm256_sub_epi16(max, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(fg_hi, 0), 0));
+    __m256i lo = blend_premultiplied_epu16_avx2(fg_lo, _mm256_unpacklo_epi8(bg, zero), inv_lo);
+    __m256i hi = blend_premultiplied_epu16_avx2(fg_hi, _mm256_unpackhi_epi8(bg, zero), inv_hi);
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_packus_epi16(lo, hi));
+  }
+  blend_span_pixels_premultiplied_sse2(dst + i, src + i, n - i);
+}
+
+// byte shuffle reversing the bytes of each pixel (in both lanes)
+#define BYTESWAP_SHUFFLE_AVX2 \
+  _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, \
+                   3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12)
+
+__attribute__((target("avx2")))
+static void rgb_to_pixels_avx2(uint32_t *dst, const uint8_t *src, size_t n) {
+  // each lane expands the first 12 bytes it is loaded with into four
+  // pixels, with a zero byte (-1 selects zero) where the alpha goes
+  const __m256i shuffle =
+    _mm256_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9,
+                     -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+  const __m256i alpha_mask = _mm256_set1_epi32(ALPHA_MASK);
+
+  size_t i = 0;
+  // (the 16-byte load of the upper lane reads 4 bytes past the 24
+  // bytes of the 8 pixels, so stop while at least 10 pixels are left)
+  for (; i + 10 <= n; i += 8) {
+    __m128i lo = _mm_loadu_si128((const __m128i *) (src + 3 * i));
+    __m128i hi = _mm_loadu_si128((const __m128i *) (src + 3 * i + 12));
+    __m256i samples = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    __m256i pixels = _mm256_or_si256(_mm256_shuffle_epi8(samples, shuffle), alpha_mask);
+    _mm256_storeu_si256((__m256i *) (dst + i), pixels);
+  }
+  rgb_to_pixels_scalar(dst + i, src + 3 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void rgba_to_pixels_avx2(uint32_t *dst, const uint8_t *src, size_t n) {
+  const __m256i shuffle = BYTESWAP_SHUFFLE_AVX2;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i samples = _mm256_loadu_si256((const __m256i *) (src + 4 * i));
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(samples, shuffle));
+  }
+  rgba_to_pixels_sse2(dst + i, src + 4 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void pixels_to_rgba_avx2(uint8_t *dst, const uint32_t *src, size_t n) {
+  const __m256i shuffle = BYTESWAP_SHUFFLE_AVX2;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i *) (src + i));
+    _mm256_storeu_si256((__m256i *) (dst + 4 * i), _mm256_shuffle_epi8(pixels, shuffle));
+  }
+  pixels_to_rgba_sse2(dst + 4 * i, src + i, n - i);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// Runtime backend selection
+////////////////////////////////////////////////////////////////////////
+
+struct BlendBackend {
+  const char *name;
+  void (*span_color)(uint32_t *dst, uint32_t color, size_t n);
+  void (*span_pixels)(uint32_t *dst, const uint32_t *src, size_t n);
+  void (*span_color_premultiplied)(uint32_t *dst, uint32_t color, size_t n);
+  void (*span_pixels_premultiplied)(uint32_t *dst, const uint32_t *src, size_t n);
+  void (*rgb_to_pixels)(uint32_t *dst, const uint8_t *src, size_t n);
+  void (*rgba_to_pixels)(uint32_t *dst, const uint8_t *src, size_t n);
+  void (*pixels_to_rgba)(uint8_t *dst, const uint32_t *src, size_t n);
+};
+
+// available backends, from least to most preferred
+static const struct BlendBackend blend_backends[] = {
+  { "scalar", blend_span_color_scalar, blend_span_pixels_scalar,
+    blend_span_color_premultiplied_scalar, blend_span_pixels_premultiplied_scalar,
+    rgb_to_pixels_scalar, rgba_to_pixels_scalar, pixels_to_rgba_scalar },
+  { "lut", blend_span_color_lut, blend_span_pixels_lut,
+    blend_span_color_premultiplied_scalar, blend_span_pixels_premultiplied_scalar,
+    rgb_to_pixels_scalar, rgba_to_pixels_scalar, pixels_to_rgba_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+  { "sse2", blend_span_color_sse2, blend_span_pixels_sse2,
+    blend_span_color_premultiplied_sse2, blend_span_pixels_premultiplied_sse2,
+    rgb_to_pixels_scalar, rgba_to_pixels_sse2, pixels_to_rgba_sse2 },
+  { "avx2", blend_span_color_avx2, blend_span_pixels_avx2,
+    blend_span_color_premultiplied_avx2, blend_span_pixels_premultiplied_avx2,
+    rgb_to_pixels_avx2, rgba_to_pixels_avx2, pixels_to_rgba_avx2 },
+#endif
+};
+
+#define NUM_BLEND_BACKENDS (sizeof(blend_backends) / sizeof(blend_backends[0]))
+
+static const struct BlendBackend *blend_backend = &blend_backends[0];
+
+/*
+ * determines whether the CPU we are running on can execute
+ * the kernels of the named backend
+ */
+static int blend_backend_supported(const char *name) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (strcmp(name, "sse2") == 0) {
+    return __builtin_cpu_supports("sse2");
+  }
+  if (strcmp(name, "avx2") == 0) {
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return strcmp(name, "scalar") == 0 || strcmp(name, "lut") == 0;
+}
+
+int set_blend_backend(const char *name) {
+  for (unsigned i = 0; i < NUM_BLEND_BACKENDS; i++) {
+    if (strcmp(blend_backends[i].name, name) == 0) {
+      if (!blend_backend_supported(name)) {
+        return -1;
+      }
+      if (strcmp(name, "lut") == 0) {
+        init_blend_mul_table();
+      }
+      blend_backend = &blend_backends[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *get_blend_backend(void) {
+  return blend_backend->name;
+}
+
+const char *get_blend_backend_name(unsigned index) {
+  return (index < NUM_BLEND_BACKENDS) ? blend_backends[index].name : NULL;
+}
+
+/*
+ * probes the CPU once at program startup and binds the best
+ * backend it supports, unless DRAW_BACKEND names a different one
+ */
+__attribute__((constructor))
+static void init_blend_backend(void) {
+  const char *forced = getenv("DRAW_BACKEND");
+  if (forced != NULL && set_blend_backend(forced) == 0) {
+    return;
+  }
+  for (unsigned i = NUM_BLEND_BACKENDS; i > 0; i--) {
+    // the lookup table is only used when explicitly requested
+    if (strcmp(blend_backends[i-1].name, "lut") != 0 && set_blend_backend(blend_backends[i-1].name) == 0) {
+      return;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Generic entry points
+////////////////////////////////////////////////////////////////////////
+
+void blend_span_color(uint32_t *dst, uint32_t color, size_t n) {
+  uint32_t alpha = color & 255;
+  if (alpha == 255) {
+    // an opaque color simply replaces the background
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = color;
+    }
+  } else if (alpha == 0) {
+    // a transparent color leaves the components unchanged, and only
+    // forces the alpha to 255, so opaque pixels need not be written
+    for (size_t i = 0; i < n; i++) {
+      if ((dst[i] & ALPHA_MASK) != ALPHA_MASK) {
+        dst[i] |= ALPHA_MASK;
+      }
+    }
+  } else {
+    blend_backend->span_color(dst, color, n);
+  }
+}
+
+void blend_span_pixels(uint32_t *dst, const uint32_t *src, size_t n) {
+  blend_backend->span_pixels(dst, src, n);
+}
+
+void blend_span_color_premultiplied(uint32_t *dst, uint32_t color, size_t n) {
+  uint32_t alpha = color & 255;
+  if (alpha == 255) {
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = color;
+    }
+  } else if (alpha != 0) {
+    // (a premultiplied transparent color is all zeroes, so it
+    // leaves the background exactly as it is)
+    blend_backend->span_color_premultiplied(dst, color, n);
+  }
+}
+
+void blend_span_pixels_premultiplied(uint32_t *dst, const uint32_t *src, size_t n) {
+  blend_backend->span_pixels_premultiplied(dst, src, n);
+}
+
+// (the vector kernels assume a little-endian CPU, which every CPU
+// they run on is)
+
+void rgb_to_pixels(uint32_t *dst, const uint8_t *src, size_t n) {
+  blend_backend->rgb_to_pixels(dst, src, n);
+}
+
+void rgba_to_pixels(uint32_t *dst, const uint8_t *src, size_t n) {
+  blend_backend->rgba_to_pixels(dst, src, n);
+}
+
+void pixels_to_rgba(uint8_t *dst, const uint32_t *src, size_t n) {
+  blend_backend->pixels_to_rgba(dst, src, n);
+}
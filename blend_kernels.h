@@ -0,0 +1,85 @@
+/*
+ * Header file for blending kernels used by the drawing functions
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#ifndef BLEND_KERNELS_H
+#define BLEND_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Each kernel blends a run of foreground colors over a run of n
+// background pixels in place, producing exactly the same result as
+// calling blend_colors on each pixel: every color component is
+// (alpha*fg + (255-alpha)*bg)/255 and the resulting alpha is 255.
+
+// Blend one constant foreground color over n background pixels
+// (used for rectangle and circle spans). Opaque colors are stored
+// without blending, and fully transparent colors only touch pixels
+// whose alpha is not already 255.
+void blend_span_color(uint32_t *dst, uint32_t color, size_t n);
+
+// Blend n foreground pixels, each with its own alpha value, over
+// n background pixels (used for sprite rows).
+void blend_span_pixels(uint32_t *dst, const uint32_t *src, size_t n);
+
+// Premultiplied alpha versions of the above: the background pixels
+// and foreground color(s) must have premultiplied alpha, and every
+// component (including alpha) becomes fg + bg*(255-alpha)/255.
+// A transparent color leaves the background unchanged.
+void blend_span_color_premultiplied(uint32_t *dst, uint32_t color, size_t n);
+void blend_span_pixels_premultiplied(uint32_t *dst, const uint32_t *src, size_t n);
+
+// Convert a color from straight to premultiplied alpha (rounding
+// to nearest), and back.
+uint32_t premultiply_color(uint32_t color);
+uint32_t unpremultiply_color(uint32_t color);
+
+// Convert n pixels from straight to premultiplied alpha, or back.
+// dst and src may be the same buffer.
+void premultiply_span(uint32_t *dst, const uint32_t *src, size_t n);
+void unpremultiply_span(uint32_t *dst, const uint32_t *src, size_t n);
+
+// Convert n pixels of 8-bit samples as stored in a PNG row (in R, G,
+// B order, followed by A for RGBA samples) to pixels, and pixels back
+// to RGBA samples. RGB samples get an alpha of 255. For the RGBA
+// conversions, dst and src may be the same buffer.
+void rgb_to_pixels(uint32_t *dst, const uint8_t *src, size_t n);
+void rgba_to_pixels(uint32_t *dst, const uint8_t *src, size_t n);
+void pixels_to_rgba(uint8_t *dst, const uint32_t *src, size_t n);
+
+// All of the blending entry points (and the sample conversions) call
+// through a table bound once at program startup to the fastest backend
+// supported by the CPU ("avx2", "sse2", "lut" or "scalar"). Setting the DRAW_BACKEND
+// environment variable to one of these names forces that backend.
+
+// Select a backend by name. Not safe to call while other threads
+// are drawing.
+//
+// Returns:
+//   0 if successful, -1 if the backend is unknown or not
+//   supported by this CPU
+int set_blend_backend(const char *name);
+
+// Returns the name of the currently selected backend.
+const char *get_blend_backend(void);
+
+// Returns the name of the index'th backend known to this build,
+// or NULL if index is out of range (for enumerating backends).
+const char *get_blend_backend_name(unsigned index);
+
+// Implementations for specific backends. The SSE2 and AVX2
+// versions must only be called on CPUs supporting those instructions.
+void blend_span_color_scalar(uint32_t *dst, uint32_t color, size_t n);
+void blend_span_pixels_scalar(uint32_t *dst, const uint32_t *src, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+void blend_span_color_sse2(uint32_t *dst, uint32_t color, size_t n);
+void blend_span_pixels_sse2(uint32_t *dst, const uint32_t *src, size_t n);
+void blend_span_color_avx2(uint32_t *dst, uint32_t color, size_t n);
+void blend_span_pixels_avx2(uint32_t *dst, const uint32_t *src, size_t n);
+#endif
+
+#endif // BLEND_KERNELS_H
@@ -10,7 +10,10 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "drawing_funcs.h"
+#include "blend_kernels.h"
+#include "sprite_runs.h"
 
 ////////////////////////////////////////////////////////////////////////
 // Helper functions
@@ -44,6 +47,8 @@ int32_t in_bounds(struct Image *img, int32_t x, int32_t y) {
  * returns the index within the array pointed to by "data" represented by the
  * equivalent x/y position given. This function is only ever called after 
  * in_bounds returns 0 and does not handle out of bounds x/y values.
+ * Rows are image_stride(img) pixels apart (so views work), and
+ * tiled images (IMG_TILED) are indexed block by block.
  * 
  * Parameters:
  *   img  - pointer to the image struct
@@ -51,12 +56,12 @@ int32_t in_bounds(struct Image *img, int32_t x, int32_t y) {
  *   y - int32_t value of height position of pixel
  *
  * Returns:
- *   a uint32_t value that represents the index within the array pointed to by "data"
+ *   a uint64_t value that represents the index within the array pointed to by "data"
  *   that would contain the same information as the (x,y) within the image
+ *   (64 bits wide, so that images may have more than 4G pixels)
  */
-uint32_t compute_index(struct Image *img, int32_t x, int32_t y) {
-  uint32_t val = y * (img->width) + x;
-  return val;
+uint64_t compute_index(struct Image *img, int32_t x, int32_t y) {
+  return image_pixel_index(img, x, y);
 }
 
 /*
@@ -188,10 +193,15 @@ uint32_t blend_colors(uint32_t fg, uint32_t bg) {
  * 
  * Parameters:
  *   img - pointer to the struct Image
- *   index - uint32_t value representing the index in the background image color array whose value should be modified
+ *   index - uint64_t value representing the index in the background image color array whose value should be modified
  *   color - uint32_t value representing a color value in the background image
+ *           (with straight alpha, even if the image uses premultiplied alpha)
  */
-void set_pixel(struct Image *img, uint32_t index, uint32_t color) {
+void set_pixel(struct Image *img, uint64_t index, uint32_t color) {
+  if (img->flags & IMG_PREMULTIPLIED) {
+    blend_span_color_premultiplied(&img->data[index], premultiply_color(color), 1);
+    return;
+  }
   uint32_t bg_color = img->data[index];
   img->data[index] = blend_colors(color, bg_color);
 }
@@ -228,6 +238,390 @@ int64_t square_dist(int64_t x1, int64_t y1, int64_t x2, int64_t y2) {
   return val;
 }
 
+/*
+ * 64-bit version of clamp, used where a coordinate plus a width
+ * or height could overflow an int32_t
+ *
+ * Parameters:
+ *   val - int64_t value to be constrained within (min, max)
+ *   min - int64_t value of lower bound of constraint
+ *   max - int64_t value of upper bound of constraint
+ *
+ * Returns:
+ *   a int64_t value that is within the bounds of (min, max)
+ */
+static int64_t clamp64(int64_t val, int64_t min, int64_t max) {
+  if (val < min) {
+    val = min;
+  }
+  else if (val > max) {
+    val = max;
+  }
+  return val;
+}
+
+/*
+ * blends a color into a horizontal run of pixels on one row of an image.
+ * the caller is responsible for making sure the span lies within the image.
+ * the color has straight alpha, and is premultiplied here if the image
+ * uses premultiplied alpha.
+ *
+ * Parameters:
+ *   img   - pointer to the struct Image
+ *   y     - int32_t row of the span
+ *   min_x - int32_t first column of the span
+ *   max_x - int32_t column one past the end of the span
+ *   color - uint32_t color value to blend into the span
+ */
+static void fill_span(struct Image *img, int32_t y, int32_t min_x, int32_t max_x, uint32_t color) {
+  int premultiplied = (img->flags & IMG_PREMULTIPLIED) != 0;
+  if (premultiplied) {
+    color = premultiply_color(color);
+  }
+  // (a span of a tiled image is split at block boundaries)
+  while (min_x < max_x) {
+    uint32_t *row = img->data + image_pixel_index(img, min_x, y);
+    int32_t n = (int32_t) image_contiguous_pixels(img, min_x, max_x - min_x);
+    if (premultiplied) {
+      blend_span_color_premultiplied(row, color, n);
+    } else {
+      blend_span_color(row, color, n);
+    }
+    min_x += n;
+  }
+}
+
+/*
+ * a clipped, rectangular block of pixels to be transferred from a
+ * source image to a destination image. dst_x/dst_y and src_x/src_y
+ * are the coordinates of the upper left visible pixel in each image,
+ * and rect_x/rect_y give the position of that pixel within the source
+ * rect (non-zero if the rect was clipped).
+ */
+struct Blit {
+  struct Image *dst_img;
+  struct Image *src_img;
+  int32_t dst_x, dst_y;
+  int32_t src_x, src_y;
+  int32_t rect_x, rect_y;
+  int32_t width, height;
+  int premultiplied;   // whether the dest image uses premultiplied alpha
+  int convert;         // whether source pixels must be converted to the dest's representation
+  uint32_t *scratch;   // buffer of CONVERT_CHUNK_PIXELS converted sprite pixels (if convert)
+};
+
+// the number of sprite pixels converted at a time when blending
+// a sprite that uses the other alpha representation
+#define CONVERT_CHUNK_PIXELS 256
+
+/*
+ * an operation on a contiguous run of dest pixels and the
+ * corresponding contiguous run of source pixels
+ */
+typedef void (*BlitOp)(const struct Blit *blit, uint32_t *dst, const uint32_t *src, int32_t n);
+
+/*
+ * determines whether two images share any pixels (for example, an
+ * image and a view of it), by comparing the ranges of their pixel
+ * buffers that they use
+ */
+static int images_share_pixels(const struct Image *a, const struct Image *b) {
+  if (a->width == 0 || a->height == 0 || b->width == 0 || b->height == 0) {
+    return 0;
+  }
+  const uint32_t *a_end = a->data + image_pixel_index(a, a->width - 1, a->height - 1) + 1;
+  const uint32_t *b_end = b->data + image_pixel_index(b, b->width - 1, b->height - 1) + 1;
+  return a->data < b_end && b->data < a_end;
+}
+
+/*
+ * determines whether a tile or sprite region lies entirely within the
+ * source image (otherwise nothing is drawn)
+ *
+ * Parameters:
+ *   src      - pointer to Image (the tilemap or spritemap)
+ *   src_rect - pointer to Rect (the region of src to copy)
+ *
+ * Returns:
+ *   1 if the region is valid, 0 if not
+ */
+static int source_rect_valid(struct Image *src, const struct Rect *src_rect) {
+  if (in_bounds(src, src_rect->x, src_rect->y) == 1) {
+    return 0;
+  }
+  if (in_bounds(src, src_rect->x + src_rect->width-1, src_rect->y + src_rect->height-1) == 1) {
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * clips the transfer of the src_rect region of the source image to
+ * position x/y of the destination image against the destination, once,
+ * so that the per-row loops need no bounds checks at all. the source
+ * region must already have been checked with source_rect_valid.
+ *
+ * Parameters:
+ *   img      - pointer to Image (dest image)
+ *   x        - x coordinate of location where the region should be copied
+ *   y        - y coordinate of location where the region should be copied
+ *   src      - pointer to Image (the tilemap or spritemap)
+ *   src_rect - pointer to Rect (the region of src to copy)
+ *   blit     - pointer to the struct Blit to fill in
+ *
+ * Returns:
+ *   1 if there are pixels to transfer, 0 if nothing is visible
+ */
+static int clip_blit_dest(struct Image *img, int32_t x, int32_t y, struct Image *src,
+                          const struct Rect *src_rect, struct Blit *blit) {
+  int64_t min_x = (x < 0) ? 0 : x;
+  int64_t min_y = (y < 0) ? 0 : y;
+  int64_t max_x = (int64_t) x + src_rect->width;
+  int64_t max_y = (int64_t) y + src_rect->height;
+  if (max_x > img->width) {
+    max_x = img->width;
+  }
+  if (max_y > img->height) {
+    max_y = img->height;
+  }
+  if (min_x >= max_x || min_y >= max_y) {
+    return 0;
+  }
+  blit->dst_img = img;
+  blit->src_img = src;
+  blit->width = (int32_t) (max_x - min_x);
+  blit->height = (int32_t) (max_y - min_y);
+  blit->premultiplied = (img->flags & IMG_PREMULTIPLIED) != 0;
+  blit->convert = blit->premultiplied != ((src->flags & IMG_PREMULTIPLIED) != 0);
+  blit->scratch = NULL;
+  blit->rect_x = (int32_t) (min_x - x);
+  blit->rect_y = (int32_t) (min_y - y);
+  blit->dst_x = (int32_t) min_x;
+  blit->dst_y = (int32_t) min_y;
+  blit->src_x = src_rect->x + blit->rect_x;
+  blit->src_y = src_rect->y + blit->rect_y;
+  return 1;
+}
+
+/*
+ * clips the transfer of the src_rect region of the source image to
+ * position x/y of the destination image against both images. the
+ * source region must lie entirely within the source image, otherwise
+ * nothing is drawn. the destination is clipped to the visible part.
+ *
+ * Returns:
+ *   1 if there are pixels to transfer, 0 if nothing is visible
+ */
+static int clip_blit(struct Image *img, int32_t x, int32_t y, struct Image *src,
+                     const struct Rect *src_rect, struct Blit *blit) {
+  return source_rect_valid(src, src_rect) && clip_blit_dest(img, x, y, src, src_rect, blit);
+}
+
+/*
+ * applies an operation to part of one row of a blit, splitting it
+ * wherever either image's pixels stop being contiguous in memory
+ * (which only happens for tiled images)
+ *
+ * Parameters:
+ *   blit - pointer to struct Blit describing the transfer
+ *   row  - int32_t row within the visible block
+ *   col  - int32_t first column within the visible block
+ *   n    - int32_t number of pixels
+ *   op   - the operation to apply
+ */
+static void blit_segment(const struct Blit *blit, int32_t row, int32_t col, int32_t n, BlitOp op) {
+  uint32_t dst_y = blit->dst_y + row, src_y = blit->src_y + row;
+  while (n > 0) {
+    uint32_t dst_x = blit->dst_x + col, src_x = blit->src_x + col;
+    uint32_t len = image_contiguous_pixels(blit->dst_img, dst_x, n);
+    len = image_contiguous_pixels(blit->src_img, src_x, len);
+    op(blit,
+       blit->dst_img->data + image_pixel_index(blit->dst_img, dst_x, dst_y),
+       blit->src_img->data + image_pixel_index(blit->src_img, src_x, src_y),
+       (int32_t) len);
+    col += len;
+    n -= len;
+  }
+}
+
+/*
+ * blends a row of sprite pixels (already in the dest image's alpha
+ * representation) over a row of the dest image
+ *
+ * Parameters:
+ *   blit - pointer to struct Blit describing the transfer
+ *   dst  - pointer to the first dest pixel
+ *   src  - pointer to the first sprite pixel
+ *   n    - int32_t number of pixels
+ */
+static void blend_row(const struct Blit *blit, uint32_t *dst, const uint32_t *src, int32_t n) {
+  if (blit->premultiplied) {
+    blend_span_pixels_premultiplied(dst, src, n);
+  } else {
+    blend_span_pixels(dst, src, n);
+  }
+}
+
+/*
+ * copies a row of source pixels to a row of the dest image,
+ * converting them to the dest image's alpha representation
+ *
+ * Parameters:
+ *   blit - pointer to struct Blit describing the transfer
+ *   dst  - pointer to the first dest pixel
+ *   src  - pointer to the first source pixel
+ *   n    - int32_t number of pixels
+ */
+static void copy_row(const struct Blit *blit, uint32_t *dst, const uint32_t *src, int32_t n) {
+  if (!blit->convert) {
+    memcpy(dst, src, n * sizeof(uint32_t));
+  } else if (blit->premultiplied) {
+    premultiply_span(dst, src, n);
+  } else {
+    unpremultiply_span(dst, src, n);
+  }
+}
+
+/*
+ * converts a row of sprite pixels to the dest image's alpha
+ * representation, then blends them over a row of the dest image
+ *
+ * Parameters:
+ *   blit - pointer to struct Blit describing the transfer
+ *   dst  - pointer to the first dest pixel
+ *   src  - pointer to the first sprite pixel
+ *   n    - int32_t number of pixels
+ */
+static void convert_blend_row(const struct Blit *blit, uint32_t *dst, const uint32_t *src, int32_t n) {
+  copy_row(blit, blit->scratch, src, n);
+  blend_row(blit, dst, blit->scratch, n);
+}
+
+/*
+ * makes a row of dest pixels opaque without changing their color
+ * components, which is what blending a fully transparent pixel does
+ * with straight alpha
+ *
+ * Parameters:
+ *   blit - pointer to struct Blit describing the transfer
+ *   dst  - pointer to the first dest pixel
+ *   src  - pointer to the first sprite pixel (unused)
+ *   n    - int32_t number of pixels
+ */
+static void skip_row(const struct Blit *blit, uint32_t *dst, const uint32_t *src, int32_t n) {
+  (void) src;
+  if (!blit->premultiplied) {
+    blend_span_color(dst, 0, n);
+  }
+}
+
+/*
+ * draws one visible row of a sprite using its run analysis: transparent
+ * runs are skipped (apart from making the background opaque, as
+ * blend_colors does, when not using premultiplied alpha), opaque runs
+ * are copied, and only the remaining runs are blended. the source and
+ * dest must use the same alpha representation.
+ *
+ * Parameters:
+ *   blit - pointer to struct Blit describing the transfer
+ *   runs - pointer to the run analysis of the sprite
+ *   row  - int32_t row within the visible block
+ */
+static void draw_sprite_row(const struct Blit *blit, const struct SpriteRuns *runs, int32_t row) {
+  int32_t start = 0;
+  int32_t visible_end = blit->rect_x + blit->width;
+  int32_t rect_row = blit->rect_y + row;
+  for (uint32_t k = runs->row_start[rect_row]; k < runs->row_start[rect_row + 1] && start < visible_end; k++) {
+    int32_t end = start + (int32_t) SPRITE_RUN_LENGTH(runs->runs[k]);
+    int32_t from = (start > blit->rect_x) ? start : blit->rect_x;
+    int32_t to = (end < visible_end) ? end : visible_end;
+    if (from < to) {
+      switch (SPRITE_RUN_TYPE(runs->runs[k])) {
+      case SPRITE_RUN_SKIP:
+        blit_segment(blit, row, from - blit->rect_x, to - from, skip_row);
+        break;
+      case SPRITE_RUN_COPY:
+        blit_segment(blit, row, from - blit->rect_x, to - from, copy_row);
+        break;
+      default:
+        blit_segment(blit, row, from - blit->rect_x, to - from, blend_row);
+      }
+    }
+    start = end;
+  }
+}
+
+/*
+ * fills the visible part of a rectangle with a color
+ * (the work of draw_rect, once the image has been invalidated)
+ *
+ * Parameters:
+ *   img   - pointer to the struct Image
+ *   rect  - pointer to struct Rect
+ *   color - uint32_t color value
+ */
+static void fill_rect(struct Image *img, const struct Rect *rect, uint32_t color) {
+  int32_t min_x = clamp(rect->x, 0, img->width);
+  int32_t max_x = (int32_t) clamp64((int64_t) rect->x + rect->width, 0, img->width);
+  int32_t min_y = clamp(rect->y, 0, img->height);
+  int32_t max_y = (int32_t) clamp64((int64_t) rect->y + rect->height, 0, img->height);
+  if (image_fill_lazy(img, min_x, min_y, max_x, max_y, color)) {
+    return;
+  }
+  image_mark_dirty(img, min_x, min_y, max_x, max_y);
+  for (int32_t j = min_y; j < max_y; j++) {
+    fill_span(img, j, min_x, max_x, color);
+  }
+}
+
+/*
+ * copies the visible part of a tile whose destination has been
+ * clipped (the work of draw_tile, once the tile has been validated)
+ *
+ * Parameters:
+ *   blit - pointer to struct Blit describing the transfer
+ */
+static void copy_blit(const struct Blit *blit) {
+  image_mark_dirty(blit->dst_img, blit->dst_x, blit->dst_y, blit->dst_x + blit->width, blit->dst_y + blit->height);
+  for (int32_t j = 0; j < blit->height; j++) {
+    blit_segment(blit, j, 0, blit->width, copy_row);
+  }
+}
+
+/*
+ * blends the visible part of a sprite whose destination has been
+ * clipped (the work of draw_sprite, once the sprite has been validated)
+ *
+ * Parameters:
+ *   blit - pointer to struct Blit describing the transfer
+ *   runs - pointer to the run analysis of the sprite, or NULL to
+ *          blend every pixel
+ */
+static void blend_blit(struct Blit *blit, const struct SpriteRuns *runs) {
+  image_mark_dirty(blit->dst_img, blit->dst_x, blit->dst_y, blit->dst_x + blit->width, blit->dst_y + blit->height);
+  if (blit->convert) {
+    // convert the sprite pixels to the dest image's representation
+    // first, a chunk of each row at a time
+    uint32_t scratch[CONVERT_CHUNK_PIXELS];
+    blit->scratch = scratch;
+    for (int32_t j = 0; j < blit->height; j++) {
+      for (int32_t i = 0; i < blit->width; i += CONVERT_CHUNK_PIXELS) {
+        int32_t n = blit->width - i;
+        blit_segment(blit, j, i, n < CONVERT_CHUNK_PIXELS ? n : CONVERT_CHUNK_PIXELS, convert_blend_row);
+      }
+    }
+    blit->scratch = NULL;
+    return;
+  }
+  for (int32_t j = 0; j < blit->height; j++) {
+    if (runs == NULL) {
+      blit_segment(blit, j, 0, blit->width, blend_row);
+    } else {
+      draw_sprite_row(blit, runs, j);
+    }
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////
 // API functions
 ////////////////////////////////////////////////////////////////////////
@@ -245,7 +639,9 @@ void draw_pixel(struct Image *img, int32_t x, int32_t y, uint32_t color) {
   if (in_bounds(img, x, y) == 1) {
     return;
   }
-  uint32_t index = compute_index(img, x, y);
+  invalidate_sprite_runs(img);
+  image_mark_dirty(img, x, y, x + 1, y + 1);
+  uint64_t index = compute_index(img, x, y);
   set_pixel(img, index, color);
 }
 
@@ -260,20 +656,16 @@ void draw_pixel(struct Image *img, int32_t x, int32_t y, uint32_t color) {
 //   color   - uint32_t color value
 //
 void draw_rect(struct Image *img, const struct Rect *rect, uint32_t color) {
-  int32_t min_x = clamp(rect->x, 0, img->width);
-  int32_t max_x = clamp(rect->x + rect->width, 0, img->width);
-  int32_t min_y = clamp(rect->y, 0, img->height);
-  int32_t max_y = clamp(rect->y + rect->height, 0, img->height);
-  for (int i = min_x; i < max_x; i++) {
-    for (int j = min_y; j < max_y; j++) {
-      draw_pixel(img, i, j, color);
-    }
-  }
+  invalidate_sprite_runs(img);
+  fill_rect(img, rect, color);
 }
 
 //
 // Draw a circle.
 // The circle has x,y as its center and has r as its radius.
+// Rather than testing every pixel of the image, each row of the
+// circle's (clipped) bounding box is filled as a single horizontal
+// span, so the cost is proportional to the circle's area.
 //
 // Parameters:
 //   img     - pointer to struct Image
@@ -283,11 +675,22 @@ void draw_rect(struct Image *img, const struct Rect *rect, uint32_t color) {
 //   color   - uint32_t color value
 //
 void draw_circle(struct Image *img, int32_t x, int32_t y, int32_t r, uint32_t color) {
-  for (int i = 0; i < img->height; i++) {
-    for (int j = 0; j < img->width; j++) {
-      if (square_dist(j, i, x, y) <= square(r)) {
-        draw_pixel(img, j, i, color);
-      }
+  invalidate_sprite_runs(img);
+  int64_t r_squared = square(r);
+  int64_t extent = (r < 0) ? -(int64_t) r : r;
+  int64_t min_y = (y - extent < 0) ? 0 : y - extent;
+  int64_t max_y = (y + extent > (int64_t) img->height - 1) ? (int64_t) img->height - 1 : y + extent;
+  int64_t box_min_x = (x - extent < 0) ? 0 : x - extent;
+  int64_t box_max_x = (x + extent > (int64_t) img->width - 1) ? (int64_t) img->width - 1 : x + extent;
+  if (box_min_x <= box_max_x && min_y <= max_y) {
+    image_mark_dirty(img, (uint32_t) box_min_x, (uint32_t) min_y, (uint32_t) box_max_x + 1, (uint32_t) max_y + 1);
+  }
+  for (int64_t i = min_y; i <= max_y; i++) {
+    int64_t half_width = isqrt(r_squared - square(i - y));
+    int64_t min_x = (x - half_width < 0) ? 0 : x - half_width;
+    int64_t max_x = (x + half_width > (int64_t) img->width - 1) ? (int64_t) img->width - 1 : x + half_width;
+    if (min_x <= max_x) {
+      fill_span(img, (int32_t) i, (int32_t) min_x, (int32_t) max_x + 1, color);
     }
   }
 }
@@ -297,7 +700,8 @@ void draw_circle(struct Image *img, int32_t x, int32_t y, int32_t r, uint32_t co
 // enclosed by the tile parameter in the tilemap image
 // to the specified x/y coordinates of the destination image.
 // No blending of the tile pixel colors with the background
-// colors should be done.
+// colors should be done. The visible part of the tile is
+// clipped once and then copied a whole row at a time.
 //
 // Parameters:
 //   img     - pointer to Image (dest image)
@@ -307,25 +711,10 @@ void draw_circle(struct Image *img, int32_t x, int32_t y, int32_t r, uint32_t co
 //   tile    - pointer to Rect (the tile)
 //
 void draw_tile(struct Image *img, int32_t x, int32_t y, struct Image *tilemap, const struct Rect *tile) {
-  if (in_bounds(tilemap, tile->x, tile->y) == 1) {
-    return;
-  }
-  if (in_bounds(tilemap, tile->x + tile->width-1, tile->y + tile->height-1) == 1) {
-    return;
-  }
-  int32_t clampedWidth = clamp(tile->width, 0, img->width - x);
-  int32_t clampedHeight = clamp(tile->height, 0, img->height - y-1);
-  int32_t yIndex = y;
-  int32_t xIndex = x;
-  for (int i = tile->x; i < tile->x + clampedWidth; i++) {
-    yIndex = y;
-    for (int j = tile->y; j < tile->y + clampedHeight; j++) {
-      int tileIndex = compute_index(tilemap, i, j);
-      int imageIndex = compute_index(img, xIndex, yIndex);
-      img->data[imageIndex] = tilemap->data[tileIndex];
-      yIndex++;
-    }
-    xIndex++;
+  struct Blit blit;
+  invalidate_sprite_runs(img);
+  if (clip_blit(img, x, y, tilemap, tile, &blit)) {
+    copy_blit(&blit);
   }
 }
 
@@ -335,7 +724,8 @@ void draw_tile(struct Image *img, int32_t x, int32_t y, struct Image *tilemap, c
 // to the specified x/y coordinates of the destination image.
 // The alpha values of the sprite pixels should be used to
 // blend the sprite pixel colors with the background
-// pixel colors.
+// pixel colors. The visible part of the sprite is clipped once
+// and then blended a whole row at a time.
 //
 // Parameters:
 //   img       - pointer to Image (dest image)
@@ -345,23 +735,125 @@ void draw_tile(struct Image *img, int32_t x, int32_t y, struct Image *tilemap, c
 //   sprite    - pointer to Rect (the sprite)
 //
 void draw_sprite(struct Image *img, int32_t x, int32_t y, struct Image *spritemap, const struct Rect *sprite) {
-  if (in_bounds(spritemap, sprite->x, sprite->y)==1) {
+  struct Blit blit;
+  invalidate_sprite_runs(img);
+  if (!clip_blit(img, x, y, spritemap, sprite, &blit)) {
     return;
   }
-  if (in_bounds(spritemap, sprite->x + sprite->width-1, sprite->y + sprite->height-1) == 1) {
-    return;
+  const struct SpriteRuns *runs = blit.convert ? NULL : get_sprite_runs(spritemap, sprite);
+  blend_blit(&blit, runs);
+  if (runs != NULL) {
+    release_sprite_runs(runs);
+  }
+}
+
+//
+// Draw n rectangles, exactly as n calls to draw_rect would
+// (in order), but invalidating and checking the image once.
+//
+// Parameters:
+//   img     - pointer to struct Image
+//   rects   - array of n struct Rects
+//   colors  - array of n uint32_t color values
+//   n       - number of rectangles
+//
+void draw_rects(struct Image *img, const struct Rect *rects, const uint32_t *colors, uint32_t n) {
+  invalidate_sprite_runs(img);
+  for (uint32_t i = 0; i < n; i++) {
+    fill_rect(img, &rects[i], colors[i]);
+  }
+}
+
+//
+// Draw n tiles from the same tilemap, exactly as n calls to
+// draw_tile would (in order). A tile region is only validated
+// against the tilemap when it differs from the previous one.
+//
+// Parameters:
+//   img     - pointer to Image (dest image)
+//   xs      - array of n x coordinates where the tiles should be copied
+//   ys      - array of n y coordinates where the tiles should be copied
+//   tilemap - pointer to Image (the tilemap)
+//   tiles   - array of n Rects (the tiles)
+//   n       - number of tiles
+//
+void draw_tiles(struct Image *img, const int32_t *xs, const int32_t *ys,
+                struct Image *tilemap, const struct Rect *tiles, uint32_t n) {
+  struct Blit blit;
+  const struct Rect *prev = NULL;
+  int valid = 0;
+  invalidate_sprite_runs(img);
+  for (uint32_t i = 0; i < n; i++) {
+    if (prev == NULL || memcmp(prev, &tiles[i], sizeof(struct Rect)) != 0) {
+      prev = &tiles[i];
+      valid = source_rect_valid(tilemap, prev);
+    }
+    if (valid && clip_blit_dest(img, xs[i], ys[i], tilemap, &tiles[i], &blit)) {
+      copy_blit(&blit);
+    }
   }
-  int32_t clampedWidth = clamp(sprite->width, 0, img->width - x);
-  int32_t clampedHeight = clamp(sprite->height, 0, img->height - y-1);
-  int32_t yIndex = y;
-  int32_t xIndex = x;
-  for (int i = sprite->x; i < sprite->x + clampedWidth; i++) {
-    yIndex = y;
-    for (int j = sprite->y; j < sprite->y + clampedHeight; j++) {
-      int spriteIndex = compute_index(spritemap, i, j);
-      draw_pixel(img, xIndex, yIndex, spritemap->data[spriteIndex]);
-      yIndex++;
+}
+
+//
+// Draw n sprites from the same spritemap, exactly as n calls to
+// draw_sprite would (in order). A sprite region is only validated
+// and looked up in the run analysis cache when it differs from the
+// previous one.
+//
+// Parameters:
+//   img       - pointer to Image (dest image)
+//   xs        - array of n x coordinates where the sprites should be copied
+//   ys        - array of n y coordinates where the sprites should be copied
+//   spritemap - pointer to Image (the spritemap)
+//   sprites   - array of n Rects (the sprites)
+//   n         - number of sprites
+//
+void draw_sprites(struct Image *img, const int32_t *xs, const int32_t *ys,
+                  struct Image *spritemap, const struct Rect *sprites, uint32_t n) {
+  struct Blit blit;
+  const struct Rect *prev = NULL;
+  const struct SpriteRuns *runs = NULL;
+  int valid = 0;
+  // (a sprite drawn onto its own spritemap may change the source of the
+  // next one, so then each sprite is analyzed again, as it would be by
+  // single calls)
+  int aliased = images_share_pixels(img, spritemap);
+  invalidate_sprite_runs(img);
+  for (uint32_t i = 0; i < n; i++) {
+    if (prev == NULL || memcmp(prev, &sprites[i], sizeof(struct Rect)) != 0) {
+      prev = &sprites[i];
+      valid = source_rect_valid(spritemap, prev);
+      if (runs != NULL) {
+        release_sprite_runs(runs);
+        runs = NULL;
+      }
+    }
+    if (valid && clip_blit_dest(img, xs[i], ys[i], spritemap, &sprites[i], &blit)) {
+      if (runs == NULL && !blit.convert) {
+        runs = get_sprite_runs(spritemap, &sprites[i]);
+      }
+      blend_blit(&blit, runs);
+      if (aliased) {
+        if (runs != NULL) {
+          release_sprite_runs(runs);
+          runs = NULL;
+        }
+        invalidate_sprite_runs(img);
+      }
     }
-    xIndex++;
   }
+  if (runs != NULL) {
+    release_sprite_runs(runs);
+  }
+}
+
+//
+// Get the struct Image flags (IMG_* representation options)
+// which this implementation of the drawing functions supports.
+//
+// Returns:
+//   bitwise OR of the supported IMG_* flags
+//
+uint32_t drawing_supported_flags(void) {
+  return IMG_PREMULTIPLIED | IMG_TILED;
 }
@@ -7,11 +7,39 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <string.h>
+#include <time.h>
 #include "image.h"
 #include "drawing_funcs.h"
+#include "sprite_runs.h"
+#include "display_list.h"
+#include "atlas.h"
+#include "pixel_alloc.h"
 
 #define NUM_IMAGE_SLOTS 8
 
+// Statistics gathered with --stats: for each kind of command (and for
+// PNG decoding/encoding), how many there were, how long they took, how
+// many canvas pixels they touched, and how many of those had to be
+// blended (rather than stored, copied or skipped). Pixel counts come
+// from the clipped geometry of each command (and the run analysis of
+// sprites cached by the C drawing functions), so gathering them costs
+// much less than the drawing itself. Only immediate drawing is measured, since deferred
+// commands are drawn long after they are read.
+enum StatKind { STAT_S, STAT_L, STAT_R, STAT_C, STAT_T, STAT_P,
+                STAT_DECODE, STAT_ENCODE, NUM_STATS };
+
+struct CommandStats {
+  uint64_t count;
+  int64_t ns;
+  uint64_t touched, blended;
+};
+
+static const char *stat_names[NUM_STATS] = {
+  "S (size)", "L (load)", "R (rect)", "C (circle)", "T (tile)", "P (sprite)",
+  "PNG decode", "PNG encode"
+};
+
 void skipws(FILE *in) {
   for (;;) {
     int c = fgetc(in);
@@ -25,12 +53,248 @@ void skipws(FILE *in) {
   }
 }
 
+
+int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Add the time since start to a statistic, and count it.
+void record_stat(struct CommandStats *stat, int64_t start) {
+  stat->count++;
+  stat->ns += now_ns() - start;
+}
+
+// Number of pixels of the w x h rectangle at x,y within the canvas.
+uint64_t visible_area(const struct Image *canvas, int64_t x, int64_t y, int64_t w, int64_t h) {
+  int64_t min_x = (x < 0) ? 0 : x, max_x = (x + w > canvas->width) ? canvas->width : x + w;
+  int64_t min_y = (y < 0) ? 0 : y, max_y = (y + h > canvas->height) ? canvas->height : y + h;
+  return (min_x < max_x && min_y < max_y) ? (uint64_t) ((max_x - min_x) * (max_y - min_y)) : 0;
+}
+
+// Number of pixels of a circle within the canvas.
+uint64_t visible_circle_pixels(const struct Image *canvas, int32_t x, int32_t y, int32_t r) {
+  int64_t extent = (r < 0) ? -(int64_t) r : r;
+  int64_t min_y = (y - extent < 0) ? 0 : y - extent;
+  int64_t max_y = (y + extent > (int64_t) canvas->height - 1) ? (int64_t) canvas->height - 1 : y + extent;
+  uint64_t count = 0;
+  for (int64_t i = min_y; i <= max_y; i++) {
+    int64_t h = isqrt(square(r) - square(i - y));
+    count += visible_area(canvas, x - h, i, 2 * h + 1, 1);
+  }
+  return count;
+}
+
+// Whether draw_tile and draw_sprite draw anything from this region.
+int region_valid(struct Image *src, const struct Rect *region) {
+  return in_bounds(src, region->x, region->y) == 0
+      && in_bounds(src, region->x + region->width - 1, region->y + region->height - 1) == 0;
+}
+
+// Number of pixels of a sprite at x,y within the canvas which must
+// be blended (those whose alpha is neither 0 nor 255), taken from the
+// run analysis the drawing functions cached when they drew it. (The
+// assembly drawing functions don't analyze sprites, so their sprite
+// pixels aren't counted.)
+uint64_t visible_sprite_blends(const struct Image *canvas, int32_t x, int32_t y,
+                               struct Image *spritemap, const struct Rect *sprite) {
+  const struct SpriteRuns *runs = find_cached_sprite_runs(spritemap, sprite);
+  if (runs == NULL) {
+    return 0;
+  }
+  uint64_t count = 0;
+  if (visible_area(canvas, x, y, sprite->width, sprite->height) == (uint64_t) sprite->width * sprite->height) {
+    count = runs->num_blend;
+  } else {
+    // count the blend runs within the visible columns of the visible rows
+    int64_t min_col = (x < 0) ? -(int64_t) x : 0;
+    int64_t max_col = (int64_t) canvas->width - x;
+    for (int64_t j = 0; j < sprite->height; j++) {
+      if (y + j < 0 || y + j >= canvas->height) {
+        continue;
+      }
+      int64_t col = 0;
+      for (uint32_t k = runs->row_start[j]; k < runs->row_start[j + 1]; k++) {
+        int64_t len = SPRITE_RUN_LENGTH(runs->runs[k]);
+        if (SPRITE_RUN_TYPE(runs->runs[k]) == SPRITE_RUN_BLEND) {
+          int64_t start = (col > min_col) ? col : min_col;
+          int64_t end = (col + len < max_col) ? col + len : max_col;
+          if (start < end) {
+            count += end - start;
+          }
+        }
+        col += len;
+      }
+    }
+  }
+  release_sprite_runs(runs);
+  return count;
+}
+
+// Print the statistics gathered with --stats.
+void print_stats(const struct CommandStats *stats) {
+  fprintf(stderr, "%-12s %10s %12s %16s %16s\n", "command", "count", "time (ms)", "pixels touched", "pixels blended");
+  for (int i = 0; i < NUM_STATS; i++) {
+    fprintf(stderr, "%-12s %10llu %12.3f %16llu %16llu\n", stat_names[i],
+            (unsigned long long) stats[i].count, stats[i].ns / 1e6,
+            (unsigned long long) stats[i].touched, (unsigned long long) stats[i].blended);
+  }
+}
+
+// Draw the commands recorded in a display list onto the canvas,
+// culling hidden drawing work first if cull_stats is not NULL.
+// Returns 0 if successful, -1 if memory could not be allocated.
+int render_display_list(struct DisplayList *dl, struct Image *canvas, uint32_t num_threads,
+                        struct DisplayCullStats *cull_stats) {
+  if (cull_stats != NULL && display_list_cull(dl, canvas, cull_stats) != 0) {
+    return -1;
+  }
+  return display_list_render_parallel(dl, canvas, 0, num_threads);
+}
+
+// read_image and write_image, adding the time taken to stat if it
+// is not NULL.
+int timed_read_image(const char *filename, struct Image *img, struct CommandStats *stat) {
+  int64_t start = (stat != NULL) ? now_ns() : 0;
+  int result = read_image(filename, img);
+  if (stat != NULL) {
+    record_stat(stat, start);
+  }
+  return result;
+}
+
+int timed_write_image(const char *filename, struct Image *img, struct CommandStats *stat) {
+  int64_t start = (stat != NULL) ? now_ns() : 0;
+  int result = write_image(filename, img);
+  if (stat != NULL) {
+    record_stat(stat, start);
+  }
+  return result;
+}
+
+// Pack the loaded images (including a newly loaded one) into a new
+// atlas, replacing the previous atlas. The loaded image structs are
+// updated in place, so commands already recorded in a display list
+// use the new atlas.
+// Returns 0 if successful, -1 if memory could not be allocated.
+int repack_atlas(struct Image *atlas, struct Image *loaded_images, int new_slot) {
+  struct Image *slots[NUM_IMAGE_SLOTS];
+  for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
+    slots[i] = &loaded_images[i];
+  }
+  struct Image old_atlas = *atlas;
+  uint32_t *new_data = loaded_images[new_slot].data;
+  if (atlas_pack(atlas, slots, NUM_IMAGE_SLOTS) != 0) {
+    free(new_data);
+    loaded_images[new_slot].data = NULL;
+    return -1;
+  }
+  if (old_atlas.data != NULL) {
+    invalidate_sprite_runs(&old_atlas);
+    free(old_atlas.data);
+  }
+  free(new_data);
+  return 0;
+}
+
+void usage(void) {
+  fprintf(stderr, "Usage: draw [options] <output PNG file>\n"
+                  "Options:\n"
+                  "  --premultiplied   store images with premultiplied alpha\n"
+                  "  --tiled           store images in square blocks of pixels\n"
+                  "  --deferred        record the drawing commands, then draw them\n"
+                  "                    one horizontal band of the canvas at a time\n"
+                  "  -j N              draw the bands using N threads (implies --deferred)\n"
+                  "  --cull            skip drawing work hidden by later opaque draws,\n"
+                  "                    and report how much was skipped (implies --deferred)\n"
+                  "  --atlas           pack the loaded images into one image\n"
+                  "  --mmap            keep the canvas in a memory-mapped temporary file\n"
+                  "  --canvas-file F   keep the canvas in the memory-mapped file F\n"
+                  "  --lazy            only fill the parts of the canvas which are drawn on\n"
+                  "  --stats           report the count, time and pixels of each kind of command\n"
+                  "                    (not with --deferred, -j or --cull, which draw the\n"
+                  "                    commands after reading them all)\n");
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  const char *output_filename = NULL;
+  uint32_t image_flags = 0;
+  int deferred = 0;
+  uint32_t num_threads = 1;
+  int cull = 0;
+  int use_atlas = 0;
+  int stats_enabled = 0;
+  int map_canvas = 0;
+  int lazy_canvas = 0;
+  const char *canvas_filename = NULL;
+  struct DisplayCullStats cull_stats = { 0, 0, 0, 0 };
+  struct CommandStats stats[NUM_STATS];
+  memset(stats, 0, sizeof(stats));
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--premultiplied") == 0) {
+      image_flags |= IMG_PREMULTIPLIED;
+    } else if (strcmp(argv[i], "--tiled") == 0) {
+      image_flags |= IMG_TILED;
+    } else if (strcmp(argv[i], "--deferred") == 0) {
+      deferred = 1;
+    } else if (strcmp(argv[i], "--cull") == 0) {
+      cull = 1;
+      deferred = 1;
+    } else if (strcmp(argv[i], "--atlas") == 0) {
+      use_atlas = 1;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats_enabled = 1;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      lazy_canvas = 1;
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      map_canvas = 1;
+    } else if (strcmp(argv[i], "--canvas-file") == 0) {
+      if (i + 1 >= argc) {
+        usage();
+        return 1;
+      }
+      canvas_filename = argv[++i];
+      map_canvas = 1;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      char *end;
+      long n = (i + 1 < argc) ? strtol(argv[i + 1], &end, 10) : 0;
+      if (n < 1 || n > 1024 || *end != '\0') {
+        usage();
+        return 1;
+      }
+      num_threads = (uint32_t) n;
+      deferred = 1;
+      i++;
+    } else if (argv[i][0] == '-' || output_filename != NULL) {
+      usage();
+      return 1;
+    } else {
+      output_filename = argv[i];
+    }
+  }
+  if (output_filename == NULL) {
     fprintf(stderr, "Error: invalid command line arguments\n");
+    usage();
     return 1;
   }
 
+  if ((image_flags & IMG_PREMULTIPLIED) && !(drawing_supported_flags() & IMG_PREMULTIPLIED)) {
+    fprintf(stderr, "Error: premultiplied alpha is not supported by these drawing functions\n");
+    return 1;
+  }
+  if ((image_flags & IMG_TILED) && !(drawing_supported_flags() & IMG_TILED)) {
+    fprintf(stderr, "Error: tiled images are not supported by these drawing functions\n");
+    return 1;
+  }
+  if (stats_enabled && deferred) {
+    fprintf(stderr, "Error: --stats can't be used with --deferred, -j or --cull\n");
+    usage();
+    return 1;
+  }
+  set_new_image_flags(image_flags);
+
   struct Image canvas = {
     .data = NULL,
     .width = 0,
@@ -38,6 +302,13 @@ int main(int argc, char **argv) {
   };
 
   struct Image loaded_images[NUM_IMAGE_SLOTS] = {{0,0,NULL}};
+  struct Image atlas = {
+    .data = NULL,
+    .width = 0,
+    .height = 0,
+  };
+  struct DisplayList display_list;
+  display_list_init(&display_list);
   uint32_t width, height;
   char cmd;
   struct Rect rect;
@@ -46,8 +317,10 @@ int main(int argc, char **argv) {
   char filename[256];
 
   int error = 0;
+  struct CommandStats *decode_stat = stats_enabled ? &stats[STAT_DECODE] : NULL;
 
   while (!error && scanf(" %c", &cmd) == 1) {
+    int64_t start = stats_enabled ? now_ns() : 0;
     switch (cmd) {
     case 'S': // "Size", must be the first command
       if (scanf("%u %u", &width, &height) != 2) {
@@ -55,10 +328,21 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Error: invalid C command\n");
         break;
       }
-      if (init_image(&canvas, width, height) != IMG_SUCCESS) {
+      // commands recorded so far apply to the old canvas
+      if (deferred && render_display_list(&display_list, &canvas, num_threads, cull ? &cull_stats : NULL) != 0) {
+        error = 1;
+        fprintf(stderr, "Error: out of memory\n");
+        break;
+      }
+      free_image(&canvas);
+      // (only the canvas is cleared lazily)
+      set_new_image_lazy(lazy_canvas);
+      if ((map_canvas ? init_image_mapped(&canvas, width, height, canvas_filename)
+                      : init_image(&canvas, width, height)) != IMG_SUCCESS) {
         error = 1;
         fprintf(stderr, "Error: could not create canvas\n");
       }
+      set_new_image_lazy(0);
       break;
 
     case 'R': // "Rectangle"
@@ -68,8 +352,11 @@ int main(int argc, char **argv) {
       } else if (scanf("%d %d %d %d %x", &rect.x, &rect.y, &rect.width, &rect.height, &color) != 5) {
         error = 1;
         fprintf(stderr, "Error: invalid rectangle\n");
-      } else {
+      } else if (!deferred) {
         draw_rect(&canvas, &rect, color);
+      } else if (display_list_add_rect(&display_list, &rect, color) != 0) {
+        error = 1;
+        fprintf(stderr, "Error: out of memory\n");
       }
       break;
 
@@ -80,8 +367,11 @@ int main(int argc, char **argv) {
       } else if (scanf("%d %d %d %x", &x, &y, &r, &color) != 4) {
         error = 1;
         fprintf(stderr, "Error: invalid circle\n");
-      } else {
+      } else if (!deferred) {
         draw_circle(&canvas, x, y, r, color);
+      } else if (display_list_add_circle(&display_list, x, y, r, color) != 0) {
+        error = 1;
+        fprintf(stderr, "Error: out of memory\n");
       }
       break;
 
@@ -97,9 +387,12 @@ int main(int argc, char **argv) {
         } else if (n < 0 || n >= NUM_IMAGE_SLOTS || loaded_images[n].data != NULL) {
           error = 1;
           fprintf(stderr, "Error: invalid image number\n");
-        } else if (read_image(filename, &loaded_images[n]) != IMG_SUCCESS) {
+        } else if (timed_read_image(filename, &loaded_images[n], decode_stat) != IMG_SUCCESS) {
           error = 1;
           fprintf(stderr, "Error: could not read image\n");
+        } else if (use_atlas && repack_atlas(&atlas, loaded_images, n) != 0) {
+          error = 1;
+          fprintf(stderr, "Error: could not pack images into atlas\n");
         }
       }
       break;
@@ -111,8 +404,11 @@ int main(int argc, char **argv) {
       } else if (n < 0 || n >= NUM_IMAGE_SLOTS || loaded_images[n].data == NULL) {
         error = 1;
         fprintf(stderr, "Error: invalid image number\n");
-      } else {
+      } else if (!deferred) {
         draw_tile(&canvas, x, y, &loaded_images[n], &rect);
+      } else if (display_list_add_tile(&display_list, x, y, &loaded_images[n], &rect) != 0) {
+        error = 1;
+        fprintf(stderr, "Error: out of memory\n");
       }
       break;
 
@@ -123,8 +419,11 @@ int main(int argc, char **argv) {
       } else if (n < 0 || n >= NUM_IMAGE_SLOTS || loaded_images[n].data == NULL) {
         error = 1;
         fprintf(stderr, "Error: invalid image number\n");
-      } else {
+      } else if (!deferred) {
         draw_sprite(&canvas, x, y, &loaded_images[n], &rect);
+      } else if (display_list_add_sprite(&display_list, x, y, &loaded_images[n], &rect) != 0) {
+        error = 1;
+        fprintf(stderr, "Error: out of memory\n");
       }
       break;
 
@@ -132,18 +431,63 @@ int main(int argc, char **argv) {
       fprintf(stderr, "Error: unrecognized command\n");
       error = 1;
     }
+
+    if (stats_enabled && !error) {
+      // (only the commands S, L, R, C, T and P get here without an error)
+      static const char stat_commands[] = "SLRCTP";
+      struct CommandStats *stat = &stats[strchr(stat_commands, cmd) - stat_commands];
+      record_stat(stat, start);
+      uint64_t touched = 0, blended = 0;
+      if (cmd == 'R' || cmd == 'C') {
+        touched = (cmd == 'R') ? visible_area(&canvas, rect.x, rect.y, rect.width, rect.height)
+                               : visible_circle_pixels(&canvas, x, y, r);
+        // (opaque colors are stored, and fully transparent ones leave
+        // the color components alone)
+        int translucent = (color & 0xFF) != 0 && (color & 0xFF) != 0xFF;
+        blended = translucent ? touched : 0;
+      } else if ((cmd == 'T' || cmd == 'P') && region_valid(&loaded_images[n], &rect)) {
+        touched = visible_area(&canvas, x, y, rect.width, rect.height);
+        if (cmd == 'P' && touched > 0) {
+          blended = visible_sprite_blends(&canvas, x, y, &loaded_images[n], &rect);
+        }
+      }
+      stat->touched += touched;
+      stat->blended += blended;
+    }
+  }
+
+  if (!error && deferred && render_display_list(&display_list, &canvas, num_threads, cull ? &cull_stats : NULL) != 0) {
+    error = 1;
+    fprintf(stderr, "Error: out of memory\n");
+  }
+  if (!error && cull) {
+    fprintf(stderr, "Occlusion culling: %u of %u commands dropped, %u clipped, %llu pixels not drawn\n",
+            cull_stats.commands_dropped, cull_stats.commands_in, cull_stats.commands_clipped,
+            (unsigned long long) cull_stats.pixels_culled);
   }
 
   // try to write output file
-  if (!error && write_image(argv[1], &canvas) != IMG_SUCCESS) {
+  if (!error && timed_write_image(output_filename, &canvas, stats_enabled ? &stats[STAT_ENCODE] : NULL) != IMG_SUCCESS) {
     error = 1;
     fprintf(stderr, "Error: could not write image\n");
   }
+  if (!error && stats_enabled) {
+    print_stats(stats);
+  }
 
-  free(canvas.data);
-  for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
-    free(loaded_images[i].data);
+  display_list_cleanup(&display_list);
+  free_image(&canvas);
+  if (use_atlas) {
+    // the loaded images are views of the atlas
+    invalidate_sprite_runs(&atlas);
+    free_image(&atlas);
+  } else {
+    for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
+      invalidate_sprite_runs(&loaded_images[i]);
+      free_image(&loaded_images[i]);
+    }
   }
+  pixel_buffer_pool_release();
 
   return (error != 0); // returns 0 IFF there was no error
 }
@@ -0,0 +1,700 @@
+/*
+ * Implementation of the deferred display list renderer
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "display_list.h"
+#include "sprite_runs.h"
+
+// approximate number of bytes of canvas pixels in a default band
+// (about half of a typical per-core L2 cache)
+#define DISPLAY_LIST_BAND_BYTES  (256 * 1024)
+
+// minimum number of bands per thread in a parallel render with the
+// default band height, so that work stealing can even out the load
+#define DISPLAY_LIST_BANDS_PER_THREAD  4
+
+// maximum number of commands drawn by one call to a batch drawing function
+#define DISPLAY_LIST_BATCH  64
+
+void display_list_init(struct DisplayList *dl) {
+  dl->cmds = NULL;
+  dl->num_cmds = 0;
+  dl->capacity = 0;
+}
+
+void display_list_cleanup(struct DisplayList *dl) {
+  free(dl->cmds);
+  display_list_init(dl);
+}
+
+/*
+ * clamps a coordinate of a bounding box to [0, INT32_MAX]
+ */
+static int32_t box_coord(int64_t val) {
+  if (val < 0) {
+    return 0;
+  }
+  return (val > INT32_MAX) ? INT32_MAX : (int32_t) val;
+}
+
+/*
+ * computes the bounding box of the pixels within a rectangle
+ */
+static struct DisplayBox rect_box(int64_t x, int64_t y, int64_t width, int64_t height) {
+  struct DisplayBox box = { 0, 0, 0, 0 };
+  if (width > 0 && height > 0) {
+    box.min_x = box_coord(x);
+    box.min_y = box_coord(y);
+    box.max_x = box_coord(x + width);
+    box.max_y = box_coord(y + height);
+  }
+  return box;
+}
+
+/*
+ * appends a command to the display list, growing it if necessary
+ *
+ * Returns:
+ *   0 if successful, -1 if memory could not be allocated
+ */
+static int add_command(struct DisplayList *dl, const struct DisplayCommand *cmd) {
+  if (dl->num_cmds == dl->capacity) {
+    uint32_t capacity = (dl->capacity == 0) ? 64 : dl->capacity * 2;
+    struct DisplayCommand *cmds = (struct DisplayCommand *) realloc(dl->cmds, capacity * sizeof(struct DisplayCommand));
+    if (cmds == NULL) {
+      return -1;
+    }
+    dl->cmds = cmds;
+    dl->capacity = capacity;
+  }
+  dl->cmds[dl->num_cmds++] = *cmd;
+  return 0;
+}
+
+int display_list_add_rect(struct DisplayList *dl, const struct Rect *rect, uint32_t color) {
+  struct DisplayCommand cmd = { .type = DL_RECT, .color = color, .rect = *rect };
+  cmd.box = rect_box(rect->x, rect->y, rect->width, rect->height);
+  return add_command(dl, &cmd);
+}
+
+int display_list_add_circle(struct DisplayList *dl, int32_t x, int32_t y, int32_t r, uint32_t color) {
+  struct DisplayCommand cmd = { .type = DL_CIRCLE, .color = color, .x = x, .y = y, .r = r };
+  // (draw_circle treats a negative radius like the positive one)
+  int64_t extent = (r < 0) ? -(int64_t) r : r;
+  cmd.box = rect_box(x - extent, y - extent, 2 * extent + 1, 2 * extent + 1);
+  return add_command(dl, &cmd);
+}
+
+int display_list_add_tile(struct DisplayList *dl, int32_t x, int32_t y,
+                          struct Image *tilemap, const struct Rect *tile) {
+  struct DisplayCommand cmd = { .type = DL_TILE, .x = x, .y = y, .rect = *tile, .src = tilemap };
+  cmd.box = rect_box(x, y, tile->width, tile->height);
+  return add_command(dl, &cmd);
+}
+
+int display_list_add_sprite(struct DisplayList *dl, int32_t x, int32_t y,
+                            struct Image *spritemap, const struct Rect *sprite) {
+  struct DisplayCommand cmd = { .type = DL_SPRITE, .x = x, .y = y, .rect = *sprite, .src = spritemap };
+  cmd.box = rect_box(x, y, sprite->width, sprite->height);
+  return add_command(dl, &cmd);
+}
+
+uint32_t display_list_band_height(uint32_t width) {
+  uint64_t rows = DISPLAY_LIST_BAND_BYTES / ((uint64_t) width * sizeof(uint32_t) + 1);
+  rows &= ~(uint64_t) IMG_BLOCK_MASK;
+  return (rows < IMG_BLOCK_SIZE) ? IMG_BLOCK_SIZE : (uint32_t) rows;
+}
+
+/*
+ * determines which bands of the canvas a command's bounding box overlaps
+ *
+ * Parameters:
+ *   box    - pointer to the command's bounding box
+ *   canvas - pointer to the canvas image
+ *   rows   - number of rows in each band
+ *   first  - set to the first band overlapped
+ *   last   - set to the last band overlapped
+ *
+ * Returns:
+ *   1 if the box overlaps the canvas, 0 if it doesn't (in which
+ *   case first and last are not set)
+ */
+static int command_bands(const struct DisplayBox *box, const struct Image *canvas,
+                         uint64_t rows, uint32_t *first, uint32_t *last) {
+  if (box->min_x >= box->max_x || (uint32_t) box->min_x >= canvas->width
+      || box->min_y >= box->max_y || (uint32_t) box->min_y >= canvas->height) {
+    return 0;
+  }
+  uint32_t last_row = ((uint32_t) box->max_y < canvas->height) ? (uint32_t) box->max_y - 1 : canvas->height - 1;
+  *first = (uint32_t) (box->min_y / rows);
+  *last = (uint32_t) (last_row / rows);
+  return 1;
+}
+
+/*
+ * draws a command into a band of the canvas whose first row is row
+ * y0 of the canvas. the command must overlap the band, which
+ * guarantees that translating it into band coordinates can't overflow.
+ */
+static void draw_command(struct Image *band, int32_t y0, const struct DisplayCommand *cmd) {
+  struct Rect rect;
+  switch (cmd->type) {
+  case DL_RECT:
+    rect = cmd->rect;
+    rect.y -= y0;
+    draw_rect(band, &rect, cmd->color);
+    break;
+  case DL_CIRCLE:
+    draw_circle(band, cmd->x, cmd->y - y0, cmd->r, cmd->color);
+    break;
+  case DL_TILE:
+    draw_tile(band, cmd->x, cmd->y - y0, cmd->src, &cmd->rect);
+    break;
+  default:
+    draw_sprite(band, cmd->x, cmd->y - y0, cmd->src, &cmd->rect);
+  }
+}
+
+/*
+ * the commands of a display list, binned by band: the commands
+ * overlapping band b are bins[bin_start[b]] .. bins[bin_start[b+1]-1],
+ * in recorded order
+ */
+struct DisplayBins {
+  uint64_t rows;        // number of rows in each band
+  uint32_t num_bands;
+  uint32_t *bin_start;
+  uint32_t *bins;
+};
+
+/*
+ * bins the commands of a display list
+ *
+ * Returns:
+ *   0 if successful, -1 if memory could not be allocated
+ */
+static int bin_commands(const struct DisplayList *dl, const struct Image *canvas,
+                        uint32_t band_height, struct DisplayBins *result) {
+  uint64_t rows = ((uint64_t) band_height + IMG_BLOCK_MASK) & ~(uint64_t) IMG_BLOCK_MASK;
+  uint32_t num_bands = (uint32_t) ((canvas->height + rows - 1) / rows);
+
+  uint32_t *bin_start = (uint32_t *) calloc((size_t) num_bands + 1, sizeof(uint32_t));
+  if (bin_start == NULL) {
+    return -1;
+  }
+  uint64_t num_entries = 0;
+  for (uint32_t i = 0; i < dl->num_cmds; i++) {
+    uint32_t first, last;
+    if (command_bands(&dl->cmds[i].box, canvas, rows, &first, &last)) {
+      for (uint32_t b = first; b <= last; b++) {
+        bin_start[b + 1]++;
+        num_entries++;
+      }
+    }
+  }
+  for (uint32_t b = 0; b < num_bands; b++) {
+    bin_start[b + 1] += bin_start[b];
+  }
+  uint32_t *bins = (uint32_t *) malloc((num_entries > 0 ? num_entries : 1) * sizeof(uint32_t));
+  uint32_t *fill = (uint32_t *) malloc(((size_t) num_bands + 1) * sizeof(uint32_t));
+  if (bins == NULL || fill == NULL) {
+    free(bin_start);
+    free(bins);
+    free(fill);
+    return -1;
+  }
+  for (uint32_t b = 0; b < num_bands; b++) {
+    fill[b] = bin_start[b];
+  }
+  for (uint32_t i = 0; i < dl->num_cmds; i++) {
+    uint32_t first, last;
+    if (command_bands(&dl->cmds[i].box, canvas, rows, &first, &last)) {
+      for (uint32_t b = first; b <= last; b++) {
+        bins[fill[b]++] = i;
+      }
+    }
+  }
+  free(fill);
+
+  result->rows = rows;
+  result->num_bands = num_bands;
+  result->bin_start = bin_start;
+  result->bins = bins;
+  return 0;
+}
+
+/*
+ * draws every command overlapping one band of the canvas, treating
+ * the band as an image of its own which shares the canvas's pixels
+ * (a band of a tiled canvas is whole block rows). consecutive
+ * rectangles, and consecutive tiles or sprites from the same source
+ * image, are drawn with the batch drawing functions.
+ */
+static void draw_band(const struct DisplayList *dl, struct Image *canvas,
+                      const struct DisplayBins *bins, uint32_t b) {
+  uint32_t y0 = (uint32_t) (b * bins->rows);
+  struct Image band = *canvas;
+  band.height = (canvas->height - y0 < bins->rows) ? canvas->height - y0 : (uint32_t) bins->rows;
+  band.data = canvas->data + image_pixel_index(canvas, 0, y0);
+  // (the canvas's dirty region is updated before the bands are drawn)
+  band.dirty = NULL;
+
+  struct Rect rects[DISPLAY_LIST_BATCH];
+  int32_t xs[DISPLAY_LIST_BATCH], ys[DISPLAY_LIST_BATCH];
+  uint32_t colors[DISPLAY_LIST_BATCH];
+  uint32_t k = bins->bin_start[b], end = bins->bin_start[b + 1];
+  while (k < end) {
+    const struct DisplayCommand *first = &dl->cmds[bins->bins[k]];
+    if (first->type == DL_CIRCLE) {
+      draw_command(&band, (int32_t) y0, first);
+      k++;
+      continue;
+    }
+
+    // gather a batch of similar commands, in band coordinates
+    // (each overlaps the band, so the translation can't overflow)
+    uint32_t n = 0;
+    while (k < end && n < DISPLAY_LIST_BATCH) {
+      const struct DisplayCommand *cmd = &dl->cmds[bins->bins[k]];
+      if (cmd->type != first->type || cmd->src != first->src) {
+        break;
+      }
+      rects[n] = cmd->rect;
+      xs[n] = cmd->x;
+      ys[n] = cmd->y - (int32_t) y0;
+      colors[n] = cmd->color;
+      if (cmd->type == DL_RECT) {
+        rects[n].y -= (int32_t) y0;
+      }
+      n++;
+      k++;
+    }
+    if (first->type == DL_RECT) {
+      draw_rects(&band, rects, colors, n);
+    } else if (first->type == DL_TILE) {
+      draw_tiles(&band, xs, ys, first->src, rects, n);
+    } else {
+      draw_sprites(&band, xs, ys, first->src, rects, n);
+    }
+  }
+}
+
+/*
+ * determines whether a tile or sprite source region lies within its
+ * source image (otherwise draw_tile and draw_sprite draw nothing)
+ */
+static int source_rect_valid(const struct Image *src, const struct Rect *rect) {
+  return rect->x >= 0 && rect->y >= 0 && rect->width > 0 && rect->height > 0
+      && (int64_t) rect->x + rect->width <= src->width
+      && (int64_t) rect->y + rect->height <= src->height;
+}
+
+/*
+ * the bands still to be drawn by one worker thread: the worker takes
+ * bands from the front, and idle workers steal them from the back
+ */
+struct BandQueue {
+  pthread_mutex_t lock;
+  uint32_t next, end;
+};
+
+/*
+ * state shared by the worker threads of a parallel render
+ */
+struct RenderJob {
+  const struct DisplayList *dl;
+  struct Image *canvas;
+  const struct DisplayBins *bins;
+  const struct SpriteRunsSet *sprites;
+  struct BandQueue *queues;
+  uint32_t num_workers;
+};
+
+struct Worker {
+  struct RenderJob *job;
+  uint32_t index;
+};
+
+/*
+ * takes a band from a worker's own queue, or failing that, steals
+ * one from another worker's queue
+ *
+ * Returns:
+ *   1 if a band was found (and stored in *band), 0 if all bands
+ *   have been taken
+ */
+static int next_band(struct RenderJob *job, uint32_t index, uint32_t *band) {
+  for (uint32_t k = 0; k < job->num_workers; k++) {
+    uint32_t victim = (index + k) % job->num_workers;
+    struct BandQueue *queue = &job->queues[victim];
+    int found = 0;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->next < queue->end) {
+      *band = (k == 0) ? queue->next++ : --queue->end;
+      found = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (found) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *render_worker(void *arg) {
+  struct Worker *worker = (struct Worker *) arg;
+  uint32_t b;
+  enter_sprite_runs_set(worker->job->sprites);
+  while (next_band(worker->job, worker->index, &b)) {
+    draw_band(worker->job->dl, worker->job->canvas, worker->job->bins, b);
+  }
+  enter_sprite_runs_set(NULL);
+  return NULL;
+}
+
+int display_list_render(struct DisplayList *dl, struct Image *canvas, uint32_t band_height) {
+  return display_list_render_parallel(dl, canvas, band_height, 1);
+}
+
+int display_list_render_parallel(struct DisplayList *dl, struct Image *canvas,
+                                 uint32_t band_height, uint32_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  if (band_height == 0) {
+    band_height = display_list_band_height(canvas->width);
+    // make sure there are enough bands to keep every thread busy
+    uint32_t balanced = canvas->height / (DISPLAY_LIST_BANDS_PER_THREAD * num_threads);
+    if (num_threads > 1 && balanced < band_height) {
+      band_height = (balanced > 0) ? balanced : 1;
+    }
+  }
+  struct DisplayBins bins;
+  if (bin_commands(dl, canvas, band_height, &bins) != 0) {
+    return -1;
+  }
+  if (num_threads > bins.num_bands) {
+    num_threads = (bins.num_bands > 0) ? bins.num_bands : 1;
+  }
+
+  // the canvas is invalidated once, and the sprite analyses are
+  // shared by the bands without locking (see struct SpriteRunsSet)
+  uint32_t num_sprites = 0;
+  for (uint32_t i = 0; i < dl->num_cmds; i++) {
+    num_sprites += (dl->cmds[i].type == DL_SPRITE);
+  }
+  struct SpriteRunsSet sprites;
+  if (sprite_runs_set_init(&sprites, canvas, num_sprites) != 0) {
+    free(bins.bin_start);
+    free(bins.bins);
+    return -1;
+  }
+  for (uint32_t i = 0; i < dl->num_cmds; i++) {
+    struct DisplayCommand *cmd = &dl->cmds[i];
+    if (cmd->type == DL_SPRITE && source_rect_valid(cmd->src, &cmd->rect)) {
+      sprite_runs_set_add(&sprites, cmd->src, &cmd->rect);
+    }
+  }
+
+  // allocate the workers' state before the canvas or the list is
+  // changed, so that nothing has been drawn if this fails
+  struct BandQueue *queues = NULL;
+  struct Worker *workers = NULL;
+  pthread_t *threads = NULL;
+  int *started = NULL;
+  if (num_threads > 1) {
+    queues = (struct BandQueue *) malloc(num_threads * sizeof(struct BandQueue));
+    workers = (struct Worker *) malloc(num_threads * sizeof(struct Worker));
+    threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    started = (int *) malloc(num_threads * sizeof(int));
+    if (queues == NULL || workers == NULL || threads == NULL || started == NULL) {
+      free(queues);
+      free(workers);
+      free(threads);
+      free(started);
+      sprite_runs_set_cleanup(&sprites);
+      free(bins.bin_start);
+      free(bins.bins);
+      return -1;
+    }
+  }
+
+  // rectangles over the whole of a lazily cleared canvas at the start
+  // of the list may only need to change its uniform color (see
+  // image_fill_lazy), in which case they are emptied so that they
+  // neither fill the canvas's tiles in nor draw anything
+  for (uint32_t i = 0; i < dl->num_cmds && dl->cmds[i].type == DL_RECT; i++) {
+    struct DisplayCommand *cmd = &dl->cmds[i];
+    uint32_t max_x = ((uint32_t) cmd->box.max_x < canvas->width) ? (uint32_t) cmd->box.max_x : canvas->width;
+    uint32_t max_y = ((uint32_t) cmd->box.max_y < canvas->height) ? (uint32_t) cmd->box.max_y : canvas->height;
+    if (!image_fill_lazy(canvas, cmd->box.min_x, cmd->box.min_y, max_x, max_y, cmd->color)) {
+      break;
+    }
+    cmd->rect.width = 0;
+    cmd->box.max_x = cmd->box.min_x;
+  }
+  if (canvas->dirty != NULL) {
+    for (uint32_t i = 0; i < dl->num_cmds; i++) {
+      uint32_t first, last;
+      const struct DisplayBox *box = &dl->cmds[i].box;
+      if (command_bands(box, canvas, bins.rows, &first, &last)) {
+        image_mark_dirty(canvas, box->min_x, box->min_y,
+                         ((uint32_t) box->max_x < canvas->width) ? (uint32_t) box->max_x : canvas->width,
+                         ((uint32_t) box->max_y < canvas->height) ? (uint32_t) box->max_y : canvas->height);
+      }
+    }
+  }
+
+  if (num_threads == 1) {
+    enter_sprite_runs_set(&sprites);
+    for (uint32_t b = 0; b < bins.num_bands; b++) {
+      draw_band(dl, canvas, &bins, b);
+    }
+    enter_sprite_runs_set(NULL);
+  } else {
+    // start each worker with an equal share of contiguous bands
+    struct RenderJob job = { dl, canvas, &bins, &sprites, queues, num_threads };
+    for (uint32_t t = 0; t < num_threads; t++) {
+      pthread_mutex_init(&queues[t].lock, NULL);
+      queues[t].next = (uint32_t) ((uint64_t) bins.num_bands * t / num_threads);
+      queues[t].end = (uint32_t) ((uint64_t) bins.num_bands * (t + 1) / num_threads);
+      workers[t].job = &job;
+      workers[t].index = t;
+    }
+
+    // the calling thread is worker 0. if a thread can't be created,
+    // its bands are stolen by the workers which are running.
+    for (uint32_t t = 1; t < num_threads; t++) {
+      started[t] = (pthread_create(&threads[t], NULL, render_worker, &workers[t]) == 0);
+    }
+    render_worker(&workers[0]);
+    for (uint32_t t = 1; t < num_threads; t++) {
+      if (started[t]) {
+        pthread_join(threads[t], NULL);
+      }
+    }
+    for (uint32_t t = 0; t < num_threads; t++) {
+      pthread_mutex_destroy(&queues[t].lock);
+    }
+    free(started);
+    free(queues);
+    free(workers);
+    free(threads);
+  }
+
+  sprite_runs_set_cleanup(&sprites);
+  free(bins.bin_start);
+  free(bins.bins);
+  dl->num_cmds = 0;
+  return 0;
+}
+
+/*
+ * the columns of one canvas row which are covered by opaque draws:
+ * span i is columns spans[2*i] .. spans[2*i+1]-1. spans are sorted,
+ * and never overlap or touch (touching spans are merged).
+ */
+struct CoverRow {
+  int32_t *spans;
+  uint32_t num_spans, capacity;
+};
+
+/*
+ * finds the first span of a row which ends at or after column x
+ */
+static uint32_t find_span(const struct CoverRow *row, int32_t x) {
+  uint32_t lo = 0, hi = row->num_spans;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (row->spans[2 * mid + 1] < x) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+ * determines whether columns min_x .. max_x-1 of a row are all covered
+ */
+static int row_covered(const struct CoverRow *row, int32_t min_x, int32_t max_x) {
+  uint32_t i = find_span(row, max_x);
+  return i < row->num_spans && row->spans[2 * i] <= min_x;
+}
+
+/*
+ * marks columns min_x .. max_x-1 of a row as covered
+ *
+ * Returns:
+ *   0 if successful, -1 if memory could not be allocated
+ */
+static int cover_row(struct CoverRow *row, int32_t min_x, int32_t max_x) {
+  if (min_x >= max_x) {
+    return 0;
+  }
+  // spans first .. last-1 overlap or touch the new span
+  uint32_t first = find_span(row, min_x);
+  uint32_t last = first;
+  while (last < row->num_spans && row->spans[2 * last] <= max_x) {
+    last++;
+  }
+  if (first == last) {
+    if (row->num_spans == row->capacity) {
+      uint32_t capacity = (row->capacity == 0) ? 4 : row->capacity * 2;
+      int32_t *spans = (int32_t *) realloc(row->spans, capacity * 2 * sizeof(int32_t));
+      if (spans == NULL) {
+        return -1;
+      }
+      row->spans = spans;
+      row->capacity = capacity;
+    }
+    memmove(&row->spans[2 * first + 2], &row->spans[2 * first], (row->num_spans - first) * 2 * sizeof(int32_t));
+    row->num_spans++;
+    row->spans[2 * first] = min_x;
+    row->spans[2 * first + 1] = max_x;
+    return 0;
+  }
+  if (row->spans[2 * first] < min_x) {
+    min_x = row->spans[2 * first];
+  }
+  if (row->spans[2 * last - 1] > max_x) {
+    max_x = row->spans[2 * last - 1];
+  }
+  row->spans[2 * first] = min_x;
+  row->spans[2 * first + 1] = max_x;
+  memmove(&row->spans[2 * first + 2], &row->spans[2 * last], (row->num_spans - last) * 2 * sizeof(int32_t));
+  row->num_spans -= last - first - 1;
+  return 0;
+}
+
+/*
+ * clips a rectangle, tile or sprite command to canvas rows
+ * min_y .. max_y-1 (which must be within the rows it covers)
+ */
+static void clip_command_rows(struct DisplayCommand *cmd, int32_t min_y, int32_t max_y) {
+  if (cmd->type == DL_RECT) {
+    cmd->rect.y = min_y;
+  } else {
+    cmd->rect.y += min_y - cmd->y;
+    cmd->y = min_y;
+  }
+  cmd->rect.height = max_y - min_y;
+  cmd->box.min_y = min_y;
+  cmd->box.max_y = max_y;
+}
+
+/*
+ * marks the pixels which a command makes opaque (regardless of what
+ * was below them) within its visible rows min_y .. max_y-1 and
+ * columns min_x .. max_x-1 as covered
+ *
+ * Returns:
+ *   0 if successful, -1 if memory could not be allocated
+ */
+static int cover_command(struct CoverRow *rows, const struct DisplayCommand *cmd,
+                         int32_t min_x, int32_t min_y, int32_t max_x, int32_t max_y) {
+  if ((cmd->type == DL_RECT && (cmd->color & 255) == 255)
+      || (cmd->type == DL_TILE && source_rect_valid(cmd->src, &cmd->rect))) {
+    for (int32_t y = min_y; y < max_y; y++) {
+      if (cover_row(&rows[y], min_x, max_x) != 0) {
+        return -1;
+      }
+    }
+  } else if (cmd->type == DL_SPRITE && source_rect_valid(cmd->src, &cmd->rect)) {
+    // only the opaque runs of each sprite row
+    const struct SpriteRuns *runs = get_sprite_runs(cmd->src, &cmd->rect);
+    if (runs == NULL) {
+      return 0;
+    }
+    int rc = 0;
+    for (int32_t y = min_y; y < max_y && rc == 0; y++) {
+      int32_t j = y - cmd->y;
+      int64_t start = cmd->x;
+      for (uint32_t k = runs->row_start[j]; k < runs->row_start[j + 1] && rc == 0; k++) {
+        int64_t end = start + SPRITE_RUN_LENGTH(runs->runs[k]);
+        if (SPRITE_RUN_TYPE(runs->runs[k]) == SPRITE_RUN_COPY) {
+          int32_t from = (start > min_x) ? (int32_t) start : min_x;
+          int32_t to = (end < max_x) ? (int32_t) end : max_x;
+          rc = cover_row(&rows[y], from, to);
+        }
+        start = end;
+      }
+    }
+    release_sprite_runs(runs);
+    return rc;
+  }
+  return 0;
+}
+
+int display_list_cull(struct DisplayList *dl, const struct Image *canvas, struct DisplayCullStats *stats) {
+  struct CoverRow *rows = (struct CoverRow *) calloc((size_t) canvas->height + 1, sizeof(struct CoverRow));
+  if (rows == NULL) {
+    return -1;
+  }
+
+  // visit the commands from last to first, so that the coverage is
+  // always that of the commands drawn after the current one
+  int rc = 0;
+  for (uint32_t i = dl->num_cmds; i-- > 0 && rc == 0; ) {
+    struct DisplayCommand *cmd = &dl->cmds[i];
+    stats->commands_in++;
+
+    // the part of the bounding box on the canvas
+    int32_t min_x = cmd->box.min_x, min_y = cmd->box.min_y;
+    int32_t max_x = ((uint32_t) cmd->box.max_x < canvas->width) ? cmd->box.max_x : (int32_t) canvas->width;
+    int32_t max_y = ((uint32_t) cmd->box.max_y < canvas->height) ? cmd->box.max_y : (int32_t) canvas->height;
+    // (a tile or sprite with an invalid source region draws nothing,
+    // and clipping its rows could make the region valid)
+    if (min_x >= max_x || min_y >= max_y
+        || ((cmd->type == DL_TILE || cmd->type == DL_SPRITE) && !source_rect_valid(cmd->src, &cmd->rect))) {
+      // nothing to draw: mark the command for removal
+      cmd->box.max_y = cmd->box.min_y;
+      continue;
+    }
+
+    // find the first and last rows which aren't hidden
+    int32_t first = min_y, last = max_y - 1;
+    while (first <= last && row_covered(&rows[first], min_x, max_x)) {
+      first++;
+    }
+    while (last > first && row_covered(&rows[last], min_x, max_x)) {
+      last--;
+    }
+    if (first > last) {
+      stats->pixels_culled += (uint64_t) (max_y - min_y) * (max_x - min_x);
+      cmd->box.max_y = cmd->box.min_y;
+      continue;
+    }
+    if (cmd->type != DL_CIRCLE && (first > min_y || last < max_y - 1)) {
+      stats->commands_clipped++;
+      stats->pixels_culled += (uint64_t) (max_y - min_y - (last + 1 - first)) * (max_x - min_x);
+      clip_command_rows(cmd, first, last + 1);
+    }
+
+    rc = cover_command(rows, cmd, min_x, first, max_x, last + 1);
+  }
+
+  // remove the commands which were marked
+  uint32_t num_kept = 0;
+  for (uint32_t i = 0; i < dl->num_cmds; i++) {
+    if (dl->cmds[i].box.min_y < dl->cmds[i].box.max_y) {
+      dl->cmds[num_kept++] = dl->cmds[i];
+    } else {
+      stats->commands_dropped++;
+    }
+  }
+  dl->num_cmds = num_kept;
+
+  for (uint32_t y = 0; y < canvas->height; y++) {
+    free(rows[y].spans);
+  }
+  free(rows);
+  return rc;
+}
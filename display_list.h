@@ -0,0 +1,127 @@
+/*
+ * Header file for the deferred display list renderer
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#ifndef DISPLAY_LIST_H
+#define DISPLAY_LIST_H
+
+#include <stdint.h>
+#include "image.h"
+#include "drawing_funcs.h"
+
+// Instead of drawing each command as soon as it is issued, commands
+// can be recorded in a display list and drawn later. The list is
+// drawn one horizontal band of the canvas at a time: every command
+// whose bounding box overlaps a band is drawn into that band (in the
+// order the commands were recorded) before moving on to the next band,
+// so the band's pixels stay in cache while all of its commands run.
+// The result is exactly the same as drawing the commands immediately.
+
+// command types
+#define DL_RECT    0
+#define DL_CIRCLE  1
+#define DL_TILE    2
+#define DL_SPRITE  3
+
+// Bounding box of the pixels a command can change, in canvas
+// coordinates (max_x and max_y are exclusive), clamped to the range
+// [0, INT32_MAX]. An empty box has min_x == max_x or min_y == max_y.
+struct DisplayBox {
+  int32_t min_x, min_y, max_x, max_y;
+};
+
+// One recorded drawing command.
+struct DisplayCommand {
+  uint32_t type;          // one of the DL_* values
+  uint32_t color;         // color (rectangles and circles)
+  int32_t x, y;           // circle center, or tile/sprite position
+  int32_t r;              // circle radius
+  struct Rect rect;       // rectangle, or tile/sprite source region
+  struct Image *src;      // tilemap or spritemap
+  struct DisplayBox box;
+};
+
+struct DisplayList {
+  struct DisplayCommand *cmds;
+  uint32_t num_cmds, capacity;
+};
+
+// Initialize an empty display list.
+void display_list_init(struct DisplayList *dl);
+
+// Free the memory used by a display list (but not the images its
+// commands refer to).
+void display_list_cleanup(struct DisplayList *dl);
+
+// Record commands, with the same parameters as draw_rect, draw_circle,
+// draw_tile and draw_sprite. Tilemaps and spritemaps must not be
+// modified or freed until the list has been rendered.
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated
+int display_list_add_rect(struct DisplayList *dl, const struct Rect *rect, uint32_t color);
+int display_list_add_circle(struct DisplayList *dl, int32_t x, int32_t y, int32_t r, uint32_t color);
+int display_list_add_tile(struct DisplayList *dl, int32_t x, int32_t y,
+                          struct Image *tilemap, const struct Rect *tile);
+int display_list_add_sprite(struct DisplayList *dl, int32_t x, int32_t y,
+                            struct Image *spritemap, const struct Rect *sprite);
+
+// Statistics of the occlusion culling pass.
+struct DisplayCullStats {
+  uint32_t commands_in;        // number of commands examined
+  uint32_t commands_dropped;   // number of commands removed entirely
+  uint32_t commands_clipped;   // number of commands with hidden rows removed
+  uint64_t pixels_culled;      // canvas pixels within the bounding boxes of
+                               // the removed commands and rows
+};
+
+// Remove drawing work which can't affect the result because it is
+// hidden by later opaque draws: rectangles with an opaque color,
+// tiles (which replace the pixels below them), and the opaque pixels
+// of sprites. Commands which are entirely hidden (or entirely off the
+// canvas) are removed from the list, and rectangles, tiles and sprites
+// whose top or bottom rows are hidden are clipped to the visible rows.
+// The list must be rendered onto the same canvas afterwards, and the
+// rendered result is unchanged.
+//
+// Parameters:
+//   dl     - pointer to the display list
+//   canvas - pointer to the canvas the list will be drawn on
+//   stats  - pointer to a struct DisplayCullStats whose counts are
+//            increased by this pass
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated (in which
+//   case the list may have been partially culled, but still renders
+//   the same result)
+int display_list_cull(struct DisplayList *dl, const struct Image *canvas, struct DisplayCullStats *stats);
+
+// Returns the default band height for a canvas of the given width:
+// a multiple of IMG_BLOCK_SIZE rows chosen so that a band fits in a
+// typical per-core cache.
+uint32_t display_list_band_height(uint32_t width);
+
+// Draw every command of the display list onto the canvas, one band
+// of band_height rows at a time, then empty the list. band_height
+// is rounded up to a multiple of IMG_BLOCK_SIZE (so that bands of a
+// tiled canvas start at a block boundary); 0 selects the default.
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated (in which
+//   case nothing has been drawn and the list is unchanged)
+int display_list_render(struct DisplayList *dl, struct Image *canvas, uint32_t band_height);
+
+// Like display_list_render, but draw the bands using num_threads
+// threads (including the calling thread). Each thread starts with an
+// equal share of the bands, and threads which run out of bands steal
+// them from the others. Since the bands are disjoint and each band's
+// commands are drawn in order, the result is the same as drawing them
+// with one thread. With band_height 0 the default is reduced if
+// necessary so that there are several bands per thread.
+int display_list_render_parallel(struct DisplayList *dl, struct Image *canvas,
+                                 uint32_t band_height, uint32_t num_threads);
+
+#endif // DISPLAY_LIST_H
@@ -17,7 +17,7 @@ struct Rect {
 
 int32_t in_bounds(struct Image *img, int32_t x, int32_t y);
 
-uint32_t compute_index(struct Image *img, int32_t x, int32_t y);
+uint64_t compute_index(struct Image *img, int32_t x, int32_t y);
 
 int32_t clamp(int32_t val, int32_t min, int32_t max);
 
@@ -33,12 +33,30 @@ uint8_t blend_components(uint32_t fg, uint32_t bg, uint32_t alpha);
 
 uint32_t blend_colors(uint32_t fg, uint32_t bg);
 
-void set_pixel(struct Image *img, uint32_t index, uint32_t color);
+void set_pixel(struct Image *img, uint64_t index, uint32_t color);
 
 int64_t square(int64_t x);
 
 int64_t square_dist(int64_t x1, int64_t y1, int64_t x2, int64_t y2);
 
+// Integer square root: the largest value whose square does not exceed
+// n (which must be non-negative). Used to find the horizontal extent
+// of a circle on a given row exactly, without floating point rounding.
+static inline int64_t isqrt(int64_t n) {
+  if (n < 2) {
+    return n;
+  }
+  // start from a power of two that is guaranteed to be >= sqrt(n),
+  // then use Newton's method, which decreases monotonically to the answer
+  uint64_t val = (uint64_t) 1 << ((64 - __builtin_clzll((uint64_t) n) + 1) / 2);
+  uint64_t next = (val + (uint64_t) n / val) / 2;
+  while (next < val) {
+    val = next;
+    next = (val + (uint64_t) n / val) / 2;
+  }
+  return (int64_t) val;
+}
+
 void draw_pixel(struct Image *img, int32_t x, int32_t y, uint32_t color);
 
 void draw_rect(struct Image *img,
@@ -59,4 +77,29 @@ void draw_sprite(struct Image *img,
                  struct Image *spritemap,
                  const struct Rect *sprite);
 
+// Batch versions of draw_rect, draw_tile and draw_sprite. Each
+// draws n items, with the same result as the equivalent sequence of
+// single calls, item 0 first. The per-item arguments are passed as
+// separate arrays so that callers can keep them in structure of
+// arrays form. All of the tiles (or sprites) of a batch come from
+// the same tilemap (or spritemap).
+void draw_rects(struct Image *img,
+                const struct Rect *rects,
+                const uint32_t *colors,
+                uint32_t n);
+
+void draw_tiles(struct Image *img,
+                const int32_t *xs, const int32_t *ys,
+                struct Image *tilemap,
+                const struct Rect *tiles,
+                uint32_t n);
+
+void draw_sprites(struct Image *img,
+                  const int32_t *xs, const int32_t *ys,
+                  struct Image *spritemap,
+                  const struct Rect *sprites,
+                  uint32_t n);
+
+uint32_t drawing_supported_flags(void);
+
 #endif // DRAWING_FUNCS_H
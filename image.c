@@ -1,41 +1,221 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "pnglite.h"
 #include "image.h"
+#include "blend_kernels.h"
+#include "drawing_funcs.h"
+#include "pixel_alloc.h"
 
 int png_init_called;
 
-int is_little_endian(void) {
-  int32_t x = 1;
-  return *((char *) &x) == 1;
+// flags for newly created images
+static uint32_t new_image_flags;
+
+// whether new images are cleared lazily
+static int new_image_lazy;
+
+// bitmaps of the dirty tiles and the unwritten tiles of an image,
+// each with one row of words per row of tiles
+struct DirtyMap {
+  uint32_t tiles_per_row, tile_rows;
+  uint32_t words_per_row;
+  uint64_t *bits;           // dirty tiles, or NULL if changes aren't tracked
+  uint64_t *unwritten;      // tiles not written since the image was lazily
+                            // cleared, or NULL if it isn't lazily cleared
+  uint32_t uniform_color;   // color of every pixel of the unwritten tiles
+  int all_unwritten;        // nonzero if no tile has been written
+};
+
+void set_new_image_flags(uint32_t flags) {
+  new_image_flags = flags;
 }
 
-uint32_t byteswap(uint32_t val) {
-  const uint8_t *p = (const uint8_t *) &val;
-  uint32_t result = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
-  return result;
+uint32_t get_new_image_flags(void) {
+  return new_image_flags;
 }
 
-int init_image(struct Image *img, uint32_t width, uint32_t height) {
-  unsigned num_pixels = width * height;
+void set_new_image_lazy(int lazy) {
+  new_image_lazy = lazy;
+}
 
-  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
-  if (pixel_data == NULL) {
-    return IMG_ERR_MALLOC_FAILED;
+static int start_lazy_clear(struct Image *img, uint32_t color);
+static void materialize_region(const struct Image *img, uint32_t min_x, uint32_t min_y,
+                               uint32_t max_x, uint32_t max_y);
+
+/*
+ * copies row y of the pixel buffer of img (which may be tiled)
+ * into a row of pixels stored contiguously
+ */
+static void copy_row_from_image(const struct Image *img, uint32_t *row, uint32_t y) {
+  for (uint32_t x = 0; x < img->width; ) {
+    uint32_t n = image_contiguous_pixels(img, x, img->width - x);
+    memcpy(row + x, img->data + image_pixel_index(img, x, y), n * sizeof(uint32_t));
+    x += n;
   }
+}
 
-  // initialize every pixel to opaque black
-  for (uint32_t i = 0; i < num_pixels; i++) {
-    pixel_data[i] = 0x000000FFU;
+/*
+ * copies row y of a lazily cleared image into a row of pixels stored
+ * contiguously, taking the pixels of unwritten tiles from the uniform
+ * color rather than the pixel buffer
+ */
+static void copy_lazy_row_from_image(const struct Image *img, const struct DirtyMap *map,
+                                     uint32_t *row, uint32_t y) {
+  const uint64_t *unwritten = map->unwritten + (size_t) (y >> IMG_BLOCK_SHIFT) * map->words_per_row;
+  for (uint32_t x = 0; x < img->width; ) {
+    uint32_t tx = x >> IMG_BLOCK_SHIFT;
+    uint32_t n = (img->width - x < IMG_BLOCK_SIZE) ? img->width - x : IMG_BLOCK_SIZE;
+    if ((unwritten[tx / 64] >> (tx % 64)) & 1) {
+      pixel_buffer_fill(row + x, n, map->uniform_color);
+    } else {
+      memcpy(row + x, img->data + image_pixel_index(img, x, y), n * sizeof(uint32_t));
+    }
+    x += n;
   }
+}
 
-  // success
+/*
+ * sets the struct Image fields of a new image with its own pixel buffer,
+ * initializing every pixel to opaque black (which is the same with
+ * straight or premultiplied alpha), or clearing the image lazily
+ */
+static void init_new_image(struct Image *img, uint32_t width, uint32_t height,
+                           uint32_t *pixel_data, uint64_t num_pixels, uint64_t mapped_size) {
   img->width = width;
   img->height = height;
   img->data = pixel_data;
+  img->flags = new_image_flags;
+  img->stride = 0;
+  img->dirty = NULL;
+  img->mapped_size = mapped_size;
+
+  // (if the lazy clearing state can't be allocated, clear the image now)
+  if (!new_image_lazy || start_lazy_clear(img, 0x000000FFU) != 0) {
+    pixel_buffer_fill(pixel_data, num_pixels, 0x000000FFU);
+  }
+}
+
+int init_image(struct Image *img, uint32_t width, uint32_t height) {
+  struct Image layout = { .width = width, .height = height, .flags = new_image_flags, .stride = 0 };
+  uint64_t num_pixels = image_num_pixels(&layout);
+
+  uint32_t *pixel_data = pixel_buffer_alloc(num_pixels);
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // success
+  init_new_image(img, width, height, pixel_data, num_pixels, 0);
+  return IMG_SUCCESS;
+}
+
+/*
+ * creates an anonymous temporary file, returning its file descriptor
+ * (or -1 if it couldn't be created)
+ */
+static int create_temp_file(void) {
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL || dir[0] == '\0') {
+    dir = "/tmp";
+  }
+  size_t len = strlen(dir) + sizeof("/canvas-XXXXXX");
+  char *path = (char *) malloc(len);
+  if (path == NULL) {
+    return -1;
+  }
+  snprintf(path, len, "%s/canvas-XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    // the file is deleted once it is no longer mapped
+    unlink(path);
+  }
+  free(path);
+  return fd;
+}
+
+int init_image_mapped(struct Image *img, uint32_t width, uint32_t height, const char *filename) {
+  struct Image layout = { .width = width, .height = height, .flags = new_image_flags, .stride = 0 };
+  uint64_t num_pixels = image_num_pixels(&layout);
+  uint64_t size = num_pixels * sizeof(uint32_t);
+  if (size == 0) {
+    // an empty mapping isn't possible
+    return init_image(img, width, height);
+  }
+
+  int fd = (filename != NULL) ? open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644) : create_temp_file();
+  if (fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  void *mem = MAP_FAILED;
+  if (size <= (uint64_t) SIZE_MAX && ftruncate(fd, (off_t) size) == 0) {
+    mem = mmap(NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  // the mapping keeps the file open
+  close(fd);
+  if (mem == MAP_FAILED) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // the pixels are initialized front to back, so the pages behind can
+  // be written back and reclaimed early. drawing then revisits pages
+  // row by row (or block row by block row), for which the default
+  // readahead around each fault suits best.
+  madvise(mem, (size_t) size, MADV_SEQUENTIAL);
+  init_new_image(img, width, height, (uint32_t *) mem, num_pixels, size);
+  madvise(mem, (size_t) size, MADV_NORMAL);
   return IMG_SUCCESS;
 }
 
+void free_image(struct Image *img) {
+  if (img->dirty != NULL) {
+    free(img->dirty->unwritten);
+    img->dirty->unwritten = NULL;
+  }
+  image_disable_dirty_tracking(img);
+  if (img->mapped_size != 0) {
+    munmap(img->data, (size_t) img->mapped_size);
+  } else {
+    pixel_buffer_free(img->data, image_num_pixels(img));
+  }
+  img->data = NULL;
+  img->mapped_size = 0;
+}
+
+/*
+ * the destination of the rows of a PNG image being read
+ */
+struct ReadRows {
+  const struct Image *img;   // the image, with its final layout
+  int rgb;                   // nonzero if the rows have RGB samples, 0 if RGBA
+};
+
+/*
+ * converts a decoded row of the PNG image into row y of the pixel buffer
+ * (called by png_get_rows as each row is decoded)
+ */
+static void read_row(const unsigned char *row, unsigned y, void *user_pointer) {
+  const struct ReadRows *rows = (const struct ReadRows *) user_pointer;
+  const struct Image *img = rows->img;
+  // (a row of a tiled image is split at block boundaries)
+  for (uint32_t x = 0; x < img->width; ) {
+    uint32_t n = image_contiguous_pixels(img, x, img->width - x);
+    uint32_t *dst = img->data + image_pixel_index(img, x, y);
+    if (rows->rgb) {
+      rgb_to_pixels(dst, row + (size_t) x * 3, n);
+    } else {
+      rgba_to_pixels(dst, row + (size_t) x * 4, n);
+    }
+    if (img->flags & IMG_PREMULTIPLIED) {
+      premultiply_span(dst, dst, n);
+    }
+    x += n;
+  }
+}
+
 int read_image(const char *filename, struct Image *img) {
   if (!png_init_called) {
     png_init(0, 0);
@@ -55,58 +235,58 @@ int read_image(const char *filename, struct Image *img) {
     return IMG_ERR_NOT_TRUECOLOR;
   }
 
-  unsigned num_pixels = png.width * png.height;
-
-  // allocate buffer for pixel data in truecolor RGBA format
-  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
-
-  if (png.color_type == PNG_TRUECOLOR) {
-    // PNG pixel data is in RGB form, expand it to add the alpha channel
-
-    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * 3);
-    if (png_get_data(&png, pixel_data_raw) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+  struct Image result = {
+    .width = png.width, .height = png.height, .flags = new_image_flags,
+    .stride = 0, .dirty = NULL, .mapped_size = 0,
+  };
+  uint64_t num_pixels = image_num_pixels(&result);
 
-    for (unsigned i = 0; i < num_pixels; i++) {
-      unsigned char r = pixel_data_raw[i*3 + 0];
-      unsigned char g = pixel_data_raw[i*3 + 1];
-      unsigned char b = pixel_data_raw[i*3 + 2];
-      unsigned char a = 255;
-
-      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | a;
-    }
-
-    free(pixel_data_raw);
-  } else {
-    // PNG pixel data is already in the correct format,
-    // except that the RGBA data is in big-endian form, so we
-    // need to byteswap if on a little endian system
-    if (png_get_data(&png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
-    }
-
-    if (is_little_endian()) {
-      for (unsigned i = 0; i < num_pixels; i++) {
-        pixel_data[i] = byteswap(pixel_data[i]);
-      }
-    }
+  // allocate buffer for pixel data in the final layout
+  result.data = pixel_buffer_alloc(num_pixels);
+  if (result.data == NULL) {
+    png_close_file(&png);
+    return IMG_ERR_MALLOC_FAILED;
   }
 
-  // communicate pixel data and image dimensions to caller
-  img->data = pixel_data;
-  img->width = png.width;
-  img->height = png.height;
+  // each row is converted to pixels (expanding RGB to RGBA, and
+  // putting the components in order on a little endian system) as
+  // soon as it is decoded, so only a couple of rows of PNG samples
+  // are ever held in memory
+  struct ReadRows rows = { &result, png.color_type == PNG_TRUECOLOR };
+  if (png_get_rows(&png, read_row, &rows) != PNG_NO_ERROR) {
+    png_close_file(&png);
+    pixel_buffer_free(result.data, num_pixels);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
   png_close_file(&png);
 
+  // communicate pixel data and image dimensions to caller
+  *img = result;
   return IMG_SUCCESS;
 }
 
+/*
+ * converts row y of img (which may be tiled, premultiplied or lazily
+ * cleared) into a row of RGBA samples of the PNG image (called by
+ * png_set_rows as each row is compressed)
+ */
+static void write_row(unsigned char *row, unsigned y, void *user_pointer) {
+  const struct Image *img = (const struct Image *) user_pointer;
+  // (the row buffer is allocated by pnglite, so it is suitably aligned
+  // for pixels, which are put in order and converted in place)
+  uint32_t *pixels = (uint32_t *) row;
+  if (img->dirty != NULL && img->dirty->unwritten != NULL) {
+    copy_lazy_row_from_image(img, img->dirty, pixels, y);
+  } else {
+    copy_row_from_image(img, pixels, y);
+  }
+  if (img->flags & IMG_PREMULTIPLIED) {
+    unpremultiply_span(pixels, pixels, img->width);
+  }
+  pixels_to_rgba(row, pixels, img->width);
+}
+
 int write_image(const char *filename, struct Image *img) {
   if (!png_init_called) {
     png_init(0, 0);
@@ -119,33 +299,311 @@ int write_image(const char *filename, struct Image *img) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
-  // if this is a little endian system, we need to byteswap
-  // every uint32_t so that it can be written in big-endian order
-  // (which is what PNG requires)
+  if (img->mapped_size != 0) {
+    // the pixels are read front to back
+    madvise(img->data, (size_t) img->mapped_size, MADV_SEQUENTIAL);
+  }
+
+  // each row is put in order, converted to straight alpha and to
+  // big-endian RGBA samples (which is what PNG requires) and
+  // compressed in turn, so only one row of samples is held in memory
+  int rc = png_set_rows(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, write_row, img);
+  int success = (rc == PNG_NO_ERROR);
+
+  png_close_file(&png);
+  if (img->mapped_size != 0) {
+    madvise(img->data, (size_t) img->mapped_size, MADV_NORMAL);
+  }
+
+  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+int image_view(struct Image *view, const struct Image *img,
+               uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+  if ((uint64_t) x + width > img->width || (uint64_t) y + height > img->height) {
+    return IMG_ERR_INVALID_VIEW;
+  }
+  if ((img->flags & IMG_TILED) && ((x | y) & IMG_BLOCK_MASK) != 0) {
+    return IMG_ERR_INVALID_VIEW;
+  }
+  if (img->dirty != NULL && img->dirty->unwritten != NULL && width > 0 && height > 0) {
+    // the view's pixels are read and written directly
+    materialize_region(img, x, y, x + width, y + height);
+  }
+  view->width = width;
+  view->height = height;
+  view->data = (x < img->width && y < img->height) ? img->data + image_pixel_index(img, x, y) : img->data;
+  view->flags = img->flags;
+  view->stride = image_stride(img);
+  view->dirty = NULL;
+  view->mapped_size = 0;
+  return IMG_SUCCESS;
+}
+
+/*
+ * allocates a tile bitmap for map (with a spare word at the end),
+ * with every bit set to value
+ */
+static uint64_t *alloc_tile_bits(const struct DirtyMap *map, int value) {
+  size_t num_words = (size_t) map->words_per_row * map->tile_rows + 1;
+  uint64_t *bits = (uint64_t *) calloc(num_words, sizeof(uint64_t));
+  if (bits != NULL && value) {
+    memset(bits, 0xFF, num_words * sizeof(uint64_t));
+  }
+  return bits;
+}
+
+/*
+ * returns the tile map of img, creating an empty one if it has none
+ * (or NULL if it couldn't be allocated)
+ */
+static struct DirtyMap *get_tile_map(struct Image *img) {
+  if (img->dirty != NULL) {
+    return img->dirty;
+  }
+  struct DirtyMap *map = (struct DirtyMap *) calloc(1, sizeof(struct DirtyMap));
+  if (map != NULL) {
+    map->tiles_per_row = (img->width + IMG_BLOCK_MASK) >> IMG_BLOCK_SHIFT;
+    map->tile_rows = (img->height + IMG_BLOCK_MASK) >> IMG_BLOCK_SHIFT;
+    map->words_per_row = (map->tiles_per_row + 63) / 64;
+    img->dirty = map;
+  }
+  return map;
+}
+
+/*
+ * frees the tile map of img if it no longer tracks anything
+ */
+static void release_tile_map(struct Image *img) {
+  struct DirtyMap *map = img->dirty;
+  if (map != NULL && map->bits == NULL && map->unwritten == NULL) {
+    free(map);
+    img->dirty = NULL;
+  }
+}
+
+/*
+ * starts clearing img to color lazily, with every tile unwritten
+ * (returns 0 if successful, -1 if memory could not be allocated)
+ */
+static int start_lazy_clear(struct Image *img, uint32_t color) {
+  struct DirtyMap *map = get_tile_map(img);
+  if (map == NULL) {
+    return -1;
+  }
+  map->unwritten = alloc_tile_bits(map, 1);
+  if (map->unwritten == NULL) {
+    release_tile_map(img);
+    return -1;
+  }
+  map->uniform_color = color;
+  map->all_unwritten = 1;
+  return 0;
+}
 
-  uint32_t *data_to_write = img->data;
-  int need_byteswap = is_little_endian();
+/*
+ * fills the pixels of tile tx, ty of img with color
+ */
+static void fill_tile(const struct Image *img, uint32_t tx, uint32_t ty, uint32_t color) {
+  uint32_t x = tx << IMG_BLOCK_SHIFT, y = ty << IMG_BLOCK_SHIFT;
+  uint32_t n = (img->width - x < IMG_BLOCK_SIZE) ? img->width - x : IMG_BLOCK_SIZE;
+  uint32_t end_y = (img->height - y < IMG_BLOCK_SIZE) ? img->height : y + IMG_BLOCK_SIZE;
+  for (; y < end_y; y++) {
+    pixel_buffer_fill(img->data + image_pixel_index(img, x, y), n, color);
+  }
+}
 
-  if (need_byteswap) {
-    data_to_write = (uint32_t *) malloc(img->width * img->height * sizeof(uint32_t));
-    if (data_to_write == NULL) {
-      png_close_file(&png);
-      return IMG_ERR_MALLOC_FAILED;
+/*
+ * fills the unwritten tiles of img which overlap columns
+ * min_x .. max_x-1 of rows min_y .. max_y-1 (which must not be empty)
+ */
+static void materialize_region(const struct Image *img, uint32_t min_x, uint32_t min_y,
+                               uint32_t max_x, uint32_t max_y) {
+  struct DirtyMap *map = img->dirty;
+  uint32_t first_tx = min_x >> IMG_BLOCK_SHIFT, last_tx = (max_x - 1) >> IMG_BLOCK_SHIFT;
+  uint32_t last_ty = (max_y - 1) >> IMG_BLOCK_SHIFT;
+  for (uint32_t ty = min_y >> IMG_BLOCK_SHIFT; ty <= last_ty; ty++) {
+    uint64_t *row = map->unwritten + (size_t) ty * map->words_per_row;
+    for (uint32_t tx = first_tx; tx <= last_tx; tx++) {
+      if (row[tx / 64] == 0) {
+        // skip to the next word
+        tx |= 63;
+        continue;
+      }
+      if ((row[tx / 64] >> (tx % 64)) & 1) {
+        fill_tile(img, tx, ty, map->uniform_color);
+        row[tx / 64] &= ~((uint64_t) 1 << (tx % 64));
+        map->all_unwritten = 0;
+      }
     }
+  }
+}
 
-    uint32_t num_pixels = img->width * img->height;
-    for (uint32_t i = 0; i < num_pixels; i++) {
-      data_to_write[i] = byteswap(img->data[i]);
+/*
+ * marks the tiles overlapping columns min_x .. max_x-1 of rows
+ * min_y .. max_y-1 (which must not be empty) as dirty
+ */
+static void mark_tiles(struct DirtyMap *map, uint32_t min_x, uint32_t min_y, uint32_t max_x, uint32_t max_y) {
+  uint32_t last_tx = (max_x - 1) >> IMG_BLOCK_SHIFT;
+  uint32_t last_ty = (max_y - 1) >> IMG_BLOCK_SHIFT;
+  for (uint32_t ty = min_y >> IMG_BLOCK_SHIFT; ty <= last_ty; ty++) {
+    uint64_t *row = map->bits + (size_t) ty * map->words_per_row;
+    for (uint32_t tx = min_x >> IMG_BLOCK_SHIFT; tx <= last_tx; tx++) {
+      row[tx / 64] |= (uint64_t) 1 << (tx % 64);
     }
   }
+}
 
-  int rc = png_set_data(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) data_to_write);
-  int success = (rc == PNG_NO_ERROR);
+int image_enable_dirty_tracking(struct Image *img) {
+  struct DirtyMap *map = get_tile_map(img);
+  if (map == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  uint64_t *bits = alloc_tile_bits(map, 0);
+  if (bits == NULL) {
+    release_tile_map(img);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  free(map->bits);
+  map->bits = bits;
+  return IMG_SUCCESS;
+}
 
-  png_close_file(&png);
-  if (need_byteswap) {
-    free(data_to_write);
+void image_disable_dirty_tracking(struct Image *img) {
+  if (img->dirty != NULL) {
+    free(img->dirty->bits);
+    img->dirty->bits = NULL;
+    release_tile_map(img);
+  }
+}
+
+void image_mark_dirty(struct Image *img, uint32_t min_x, uint32_t min_y, uint32_t max_x, uint32_t max_y) {
+  struct DirtyMap *map = img->dirty;
+  if (map == NULL || min_x >= max_x || min_y >= max_y) {
+    return;
+  }
+  if (map->unwritten != NULL) {
+    // the pixels are about to change, so they must exist
+    materialize_region(img, min_x, min_y, max_x, max_y);
+  }
+  if (map->bits != NULL) {
+    mark_tiles(map, min_x, min_y, max_x, max_y);
+  }
+}
+
+void image_clear_dirty(struct Image *img) {
+  if (img->dirty != NULL && img->dirty->bits != NULL) {
+    memset(img->dirty->bits, 0, (size_t) img->dirty->words_per_row * img->dirty->tile_rows * sizeof(uint64_t));
   }
+}
 
-  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+void image_materialize(struct Image *img) {
+  if (img->dirty != NULL && img->dirty->unwritten != NULL && img->width > 0 && img->height > 0) {
+    materialize_region(img, 0, 0, img->width, img->height);
+  }
+}
+
+int image_fill_lazy(struct Image *img, uint32_t min_x, uint32_t min_y,
+                    uint32_t max_x, uint32_t max_y, uint32_t color) {
+  struct DirtyMap *map = img->dirty;
+  if (map == NULL || map->unwritten == NULL || min_x != 0 || min_y != 0
+      || max_x != img->width || max_y != img->height || max_x == 0 || max_y == 0) {
+    return 0;
+  }
+  int opaque = (color & 255) == 255;
+  if (!opaque && !map->all_unwritten) {
+    return 0;
+  }
+  // blend the color over the uniform color exactly as the pixels would be
+  uint32_t uniform = map->uniform_color;
+  if (img->flags & IMG_PREMULTIPLIED) {
+    blend_span_color_premultiplied(&uniform, premultiply_color(color), 1);
+  } else {
+    blend_span_color(&uniform, color, 1);
+  }
+  if (opaque && !map->all_unwritten) {
+    // every tile becomes the new color again
+    memset(map->unwritten, 0xFF, ((size_t) map->words_per_row * map->tile_rows + 1) * sizeof(uint64_t));
+    map->all_unwritten = 1;
+  }
+  map->uniform_color = uniform;
+  if (map->bits != NULL) {
+    mark_tiles(map, 0, 0, img->width, img->height);
+  }
+  return 1;
+}
+
+/*
+ * determines whether tile tx of a row of the dirty bitmap is dirty
+ */
+static int tile_dirty(const struct DirtyMap *map, uint32_t tx, uint32_t ty) {
+  const uint64_t *row = map->bits + (size_t) ty * map->words_per_row;
+  return (row[tx / 64] >> (tx % 64)) & 1;
+}
+
+/*
+ * determines whether tiles start .. end-1 of tile row ty are a run of
+ * dirty tiles which can't be extended to the left or right
+ */
+static int is_dirty_run(const struct DirtyMap *map, uint32_t ty, uint32_t start, uint32_t end) {
+  if ((start > 0 && tile_dirty(map, start - 1, ty)) || (end < map->tiles_per_row && tile_dirty(map, end, ty))) {
+    return 0;
+  }
+  for (uint32_t tx = start; tx < end; tx++) {
+    if (!tile_dirty(map, tx, ty)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+uint32_t image_get_dirty_rects(const struct Image *img, struct Rect *rects, uint32_t max_rects) {
+  const struct DirtyMap *map = img->dirty;
+  if (map == NULL || map->bits == NULL) {
+    if (img->width == 0 || img->height == 0) {
+      return 0;
+    }
+    if (max_rects > 0) {
+      rects[0].x = 0;
+      rects[0].y = 0;
+      rects[0].width = (int32_t) img->width;
+      rects[0].height = (int32_t) img->height;
+    }
+    return 1;
+  }
+
+  // each run of dirty tiles in a tile row starts a rectangle, unless
+  // the row above has exactly the same run (in which case it is part
+  // of that row's rectangle), and the rectangle extends down for as
+  // long as the rows below have exactly the same run
+  uint32_t num_rects = 0;
+  for (uint32_t ty = 0; ty < map->tile_rows; ty++) {
+    uint32_t tx = 0;
+    while (tx < map->tiles_per_row) {
+      if (!tile_dirty(map, tx, ty)) {
+        tx++;
+        continue;
+      }
+      uint32_t start = tx;
+      while (tx < map->tiles_per_row && tile_dirty(map, tx, ty)) {
+        tx++;
+      }
+      if (ty > 0 && is_dirty_run(map, ty - 1, start, tx)) {
+        continue;
+      }
+      uint32_t end_ty = ty + 1;
+      while (end_ty < map->tile_rows && is_dirty_run(map, end_ty, start, tx)) {
+        end_ty++;
+      }
+      if (num_rects < max_rects) {
+        uint32_t max_x = tx << IMG_BLOCK_SHIFT, max_y = end_ty << IMG_BLOCK_SHIFT;
+        rects[num_rects].x = (int32_t) (start << IMG_BLOCK_SHIFT);
+        rects[num_rects].y = (int32_t) (ty << IMG_BLOCK_SHIFT);
+        rects[num_rects].width = (int32_t) ((max_x < img->width ? max_x : img->width) - (start << IMG_BLOCK_SHIFT));
+        rects[num_rects].height = (int32_t) ((max_y < img->height ? max_y : img->height) - (ty << IMG_BLOCK_SHIFT));
+      }
+      num_rects++;
+    }
+  }
+  return num_rects;
 }
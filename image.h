@@ -3,18 +3,125 @@
 
 #include <stdint.h>
 
+// values for the flags field of struct Image
+#define IMG_PREMULTIPLIED        0x1  // color components are premultiplied by alpha
+#define IMG_TILED                0x2  // pixels are stored in square blocks (see below)
+
+// A tiled image stores its pixels in IMG_BLOCK_SIZE x IMG_BLOCK_SIZE
+// blocks, so that pixels which are close together vertically are also
+// close together in memory. The blocks are stored in row-major order,
+// and so are the pixels within each block. Blocks at the right and
+// bottom edges are padded to full size, so the pixel buffer of a tiled
+// image holds image_num_pixels(img) pixels rather than width*height.
+#define IMG_BLOCK_SHIFT          5
+#define IMG_BLOCK_SIZE           (1U << IMG_BLOCK_SHIFT)
+#define IMG_BLOCK_MASK           (IMG_BLOCK_SIZE - 1)
+
+struct DirtyMap;
+
 struct Image {
   uint32_t width;
   uint32_t height;
   uint32_t *data;
+  uint32_t flags;
+  uint32_t stride;         // pixel columns in the buffer, or 0 if the same as width
+  struct DirtyMap *dirty;  // changed regions and unwritten tiles (see below),
+                           // or NULL if neither is tracked
+  uint64_t mapped_size;    // bytes of the file mapping holding the pixels,
+                           // or 0 if they were allocated with malloc
 };
 
+// An image can be a view of a rectangular region of another image's
+// pixels (see image_view), in which case its rows are further apart
+// in memory than its width: the stride is the number of pixel columns
+// of the underlying buffer (for a tiled image, including the padding
+// of the blocks at the right edge, so it is a multiple of
+// IMG_BLOCK_SIZE). A stride of 0 means the rows are packed.
+
+// Number of pixel columns in the pixel buffer of an image.
+static inline uint32_t image_stride(const struct Image *img) {
+  if (img->stride != 0) {
+    return img->stride;
+  }
+  if (img->flags & IMG_TILED) {
+    return (img->width + IMG_BLOCK_MASK) & ~IMG_BLOCK_MASK;
+  }
+  return img->width;
+}
+
+// Number of blocks in each row of blocks of a tiled image.
+static inline uint32_t image_blocks_per_row(const struct Image *img) {
+  return image_stride(img) >> IMG_BLOCK_SHIFT;
+}
+
+// Number of pixels in the pixel buffer of an image which owns its
+// buffer (including the padding of a tiled image).
+static inline uint64_t image_num_pixels(const struct Image *img) {
+  if (img->flags & IMG_TILED) {
+    uint64_t block_rows = (img->height + IMG_BLOCK_MASK) >> IMG_BLOCK_SHIFT;
+    return block_rows * image_blocks_per_row(img) << (2 * IMG_BLOCK_SHIFT);
+  }
+  return (uint64_t) img->width * img->height;
+}
+
+// Index in the pixel buffer of the pixel at column x, row y,
+// which must be within the bounds of the image.
+static inline uint64_t image_pixel_index(const struct Image *img, uint32_t x, uint32_t y) {
+  if (img->flags & IMG_TILED) {
+    uint64_t block = (uint64_t) (y >> IMG_BLOCK_SHIFT) * image_blocks_per_row(img) + (x >> IMG_BLOCK_SHIFT);
+    return (block << (2 * IMG_BLOCK_SHIFT)) + ((y & IMG_BLOCK_MASK) << IMG_BLOCK_SHIFT) + (x & IMG_BLOCK_MASK);
+  }
+  return (uint64_t) y * image_stride(img) + x;
+}
+
+// Number of pixels (at most n) starting at column x of a row which
+// are stored contiguously in the pixel buffer.
+static inline uint32_t image_contiguous_pixels(const struct Image *img, uint32_t x, uint32_t n) {
+  if (img->flags & IMG_TILED) {
+    uint32_t to_block_end = IMG_BLOCK_SIZE - (x & IMG_BLOCK_MASK);
+    return (n < to_block_end) ? n : to_block_end;
+  }
+  return n;
+}
+
 // return values from init_image, read_image, and write_image
 #define IMG_SUCCESS              0
 #define IMG_ERR_COULD_NOT_OPEN   -1
 #define IMG_ERR_NOT_TRUECOLOR    -2
 #define IMG_ERR_MALLOC_FAILED    -3
 #define IMG_ERR_COULD_NOT_WRITE  -4
+#define IMG_ERR_INVALID_VIEW     -5
+
+// Select the representation used by images subsequently created by
+// init_image and read_image. IMG_PREMULTIPLIED stores pixels with
+// premultiplied alpha, which makes blending cheaper, and IMG_TILED
+// stores them in blocks. write_image always writes straight alpha in
+// row order. Drawing functions only support a representation if
+// drawing_supported_flags() includes its flag.
+//
+// Premultiplied images composite rather than paint: blending gives
+// the dest pixel alpha a + bg_a*(255-a)/255, and transparent colors
+// and sprite pixels leave it unchanged, whereas straight alpha images
+// make every blended pixel opaque. The two only give the same output
+// (to within 1 in each color component) on opaque images; blending
+// over translucent pixels, such as ones copied by draw_tile, writes
+// different alpha values to the PNG.
+//
+// Parameters:
+//   flags - combination of IMG_* flags (0, the default, gives
+//           straight alpha in row order)
+void set_new_image_flags(uint32_t flags);
+
+// Returns the flags given to images created by init_image and read_image.
+uint32_t get_new_image_flags(void);
+
+// Select whether images subsequently created by init_image and
+// init_image_mapped are cleared lazily (see below).
+//
+// Parameters:
+//   lazy - nonzero to clear new images lazily, 0 (the default) to
+//          write all of their pixels when they are created
+void set_new_image_lazy(int lazy);
 
 // Initialize an Image struct instance by creating a pixel
 // buffer large enough to accommodate an image of the specified
@@ -33,6 +140,36 @@ struct Image {
 //   IMG_ERR_* values
 int init_image(struct Image *img, uint32_t width, uint32_t height);
 
+// Like init_image, but the pixel buffer is a shared memory mapping of
+// a file rather than being allocated with malloc, so the kernel can
+// write its cold regions back to the file and reclaim their memory.
+// This allows canvases larger than the available RAM. The file is
+// created (or truncated) and grown to the size of the buffer; it holds
+// the raw pixel buffer, not a PNG image. Without a filename, an
+// anonymous temporary file in $TMPDIR (or /tmp) is used, which is
+// deleted once the image is freed. The image must be freed with
+// free_image.
+//
+// Parameters:
+//   img - pointer to Image instance to initialize
+//   width - image width (number of pixel columns)
+//   height - image height (number of pixel rows)
+//   filename - name of the file to map, or NULL for a temporary file
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_COULD_NOT_OPEN if the file
+//   couldn't be created, or IMG_ERR_MALLOC_FAILED if it couldn't be
+//   grown or mapped
+int init_image_mapped(struct Image *img, uint32_t width, uint32_t height, const char *filename);
+
+// Free the pixel buffer of an image created by init_image,
+// init_image_mapped or read_image (unmapping it if it is a file
+// mapping), stop tracking its changes, and free its lazy clearing
+// state. Its sprite runs, if any,
+// must be invalidated first. Views must not be freed. Does nothing if
+// img->data is NULL.
+void free_image(struct Image *img);
+
 // Read PNG image data from a file and initialize the specified
 // Image struct instance.
 //
@@ -59,4 +196,100 @@ int read_image(const char *filename, struct Image *img);
 //   IMG_ERR_* values
 int write_image(const char *filename, struct Image *img);
 
+// Initialize an Image struct instance as a view of the region of img
+// with its upper left corner at column x, row y. The view shares the
+// pixels of img, so drawing on the view changes img (and vice versa),
+// and nothing is allocated: the view must not be freed, and is only
+// valid as long as img's pixel data is. Views don't track dirty
+// regions. A view of a tiled image must start at a block boundary.
+//
+// Parameters:
+//   view - pointer to Image instance to initialize
+//   img - pointer to the image to view a region of
+//   x, y - upper left corner of the region
+//   width, height - size of the region
+//
+// Returns:
+//   IMG_SUCCESS if successful, or IMG_ERR_INVALID_VIEW if the region
+//   isn't entirely within img (or isn't aligned to a block boundary)
+int image_view(struct Image *view, const struct Image *img,
+               uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+// Dirty region tracking. When enabled for an image, the drawing
+// functions record which parts of it they change, as a bitmap of
+// IMG_BLOCK_SIZE x IMG_BLOCK_SIZE tiles, so that later processing
+// (re-encoding, diffing, compositing) can be limited to the changed
+// pixels. The reported region may include some unchanged pixels,
+// but never misses a changed one.
+
+struct Rect;
+
+// Start tracking the changes to an image. Initially nothing is dirty.
+// image_disable_dirty_tracking must be called before the image's
+// pixel data is freed.
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise IMG_ERR_MALLOC_FAILED
+int image_enable_dirty_tracking(struct Image *img);
+
+// Stop tracking the changes to an image, freeing the dirty region.
+void image_disable_dirty_tracking(struct Image *img);
+
+// Record that the pixels in columns min_x .. max_x-1 of rows
+// min_y .. max_y-1 may have changed. Does nothing if the image's
+// changes aren't being tracked. The region must lie within the image.
+// Must not be called for the same image by several threads at once.
+void image_mark_dirty(struct Image *img, uint32_t min_x, uint32_t min_y, uint32_t max_x, uint32_t max_y);
+
+// Get the dirty region of an image as a list of non-overlapping
+// rectangles (the tiles marked dirty, merged horizontally, then
+// vertically, and clipped to the image). At most max_rects
+// rectangles are stored in rects.
+//
+// Returns:
+//   the number of rectangles in the dirty region (which may be
+//   more than max_rects). An image whose changes aren't being
+//   tracked is reported as entirely dirty.
+uint32_t image_get_dirty_rects(const struct Image *img, struct Rect *rects, uint32_t max_rects);
+
+// Mark the whole image as clean.
+void image_clear_dirty(struct Image *img);
+
+// Lazy clearing. A lazily cleared image doesn't write its initial
+// opaque black pixels when it is created. Instead, every
+// IMG_BLOCK_SIZE x IMG_BLOCK_SIZE tile is known to be a single uniform
+// color until the first time it is drawn on, when it is filled with
+// that color. A rectangle drawn over the whole image changes the
+// uniform color without writing any pixels, if it is opaque or no tile
+// has been written yet, and write_image encodes the tiles which were
+// never written without filling them. So creating a large canvas and
+// filling it with a background color is cheap, and the memory of the
+// parts of a sparsely drawn canvas which are never drawn on is never
+// touched. The unwritten tiles are tracked in the same tile map as the
+// dirty region (which the drawing functions update before they change
+// any pixels).
+//
+// The drawing functions, image_view (which fills the tiles a view
+// covers), write_image and free_image handle lazily cleared images.
+// Code which reads the pixel buffer directly, or uses the image as a
+// tilemap or spritemap, must call image_materialize first. A lazily
+// cleared image must be freed with free_image.
+
+// Fill every tile of a lazily cleared image which hasn't been written
+// yet. Does nothing for other images.
+void image_materialize(struct Image *img);
+
+// Called by the drawing functions before they fill the pixels in
+// columns min_x .. max_x-1 of rows min_y .. max_y-1 (which must lie
+// within the image) with a rectangle of the given color. If the
+// image is lazily cleared, the region is the whole image, and either
+// the color is opaque or no tile has been written yet, the fill is
+// done by changing the uniform color of the image (and marking the
+// image as dirty).
+//
+// Returns:
+//   1 if the fill has been done, 0 if the pixels must be drawn
+int image_fill_lazy(struct Image *img, uint32_t min_x, uint32_t min_y,
+                    uint32_t max_x, uint32_t max_y, uint32_t color);
+
 #endif
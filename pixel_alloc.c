@@ -0,0 +1,138 @@
+/*
+ * Implementation of the pixel buffer allocator
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "pixel_alloc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// number of freed buffers kept for reuse
+#define POOL_SLOTS 4
+
+// buffers at least this large are filled with non-temporal stores,
+// since they don't fit in the cache anyway
+#define STREAM_FILL_BYTES (4U << 20)
+
+struct PoolEntry {
+  uint32_t *data;
+  uint64_t num_pixels;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct PoolEntry pool[POOL_SLOTS];
+static unsigned pool_entries;
+
+/*
+ * computes the number of bytes to allocate for a buffer of num_pixels
+ * pixels (a whole number of huge pages for large buffers), or 0 if it
+ * is too large to allocate
+ */
+static size_t buffer_bytes(uint64_t num_pixels) {
+  if (num_pixels == 0) {
+    // (a buffer for no pixels still needs a unique pointer)
+    return PIXEL_BUFFER_ALIGN;
+  }
+  if (num_pixels > (SIZE_MAX - PIXEL_HUGE_PAGE_SIZE) / sizeof(uint32_t)) {
+    return 0;
+  }
+  size_t bytes = (size_t) num_pixels * sizeof(uint32_t);
+  if (bytes >= PIXEL_HUGE_PAGE_SIZE) {
+    bytes = (bytes + PIXEL_HUGE_PAGE_SIZE - 1) & ~((size_t) PIXEL_HUGE_PAGE_SIZE - 1);
+  }
+  return bytes;
+}
+
+uint32_t *pixel_buffer_alloc(uint64_t num_pixels) {
+  // reuse a pooled buffer of the same size if there is one
+  pthread_mutex_lock(&pool_lock);
+  for (unsigned i = 0; i < pool_entries; i++) {
+    if (pool[i].num_pixels == num_pixels) {
+      uint32_t *data = pool[i].data;
+      pool[i] = pool[--pool_entries];
+      pthread_mutex_unlock(&pool_lock);
+      return data;
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  size_t bytes = buffer_bytes(num_pixels);
+  if (bytes == 0) {
+    return NULL;
+  }
+  int huge = (bytes >= PIXEL_HUGE_PAGE_SIZE);
+  void *data;
+  if (posix_memalign(&data, huge ? PIXEL_HUGE_PAGE_SIZE : PIXEL_BUFFER_ALIGN, bytes) != 0) {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge) {
+    // only a hint: without transparent huge pages this fails harmlessly
+    madvise(data, bytes, MADV_HUGEPAGE);
+  }
+#endif
+  return (uint32_t *) data;
+}
+
+void pixel_buffer_free(uint32_t *data, uint64_t num_pixels) {
+  if (data == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool_lock);
+  if (pool_entries < POOL_SLOTS) {
+    pool[pool_entries].data = data;
+    pool[pool_entries].num_pixels = num_pixels;
+    pool_entries++;
+    data = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  free(data);
+}
+
+void pixel_buffer_pool_release(void) {
+  pthread_mutex_lock(&pool_lock);
+  for (unsigned i = 0; i < pool_entries; i++) {
+    free(pool[i].data);
+  }
+  pool_entries = 0;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void pixel_buffer_fill(uint32_t *data, uint64_t num_pixels, uint32_t color) {
+  uint64_t i = 0;
+#if defined(__SSE2__)
+  // store single pixels up to a 16-byte boundary, then 64 bytes at a time
+  while (i < num_pixels && ((uintptr_t) (data + i) & 15) != 0) {
+    data[i++] = color;
+  }
+  __m128i v = _mm_set1_epi32((int) color);
+  uint64_t end = i + ((num_pixels - i) & ~(uint64_t) 15);
+  if (num_pixels * sizeof(uint32_t) >= STREAM_FILL_BYTES) {
+    for (; i < end; i += 16) {
+      _mm_stream_si128((__m128i *) (data + i), v);
+      _mm_stream_si128((__m128i *) (data + i + 4), v);
+      _mm_stream_si128((__m128i *) (data + i + 8), v);
+      _mm_stream_si128((__m128i *) (data + i + 12), v);
+    }
+    // make the non-temporal stores visible before the buffer is used
+    _mm_sfence();
+  } else {
+    for (; i < end; i += 16) {
+      _mm_store_si128((__m128i *) (data + i), v);
+      _mm_store_si128((__m128i *) (data + i + 4), v);
+      _mm_store_si128((__m128i *) (data + i + 8), v);
+      _mm_store_si128((__m128i *) (data + i + 12), v);
+    }
+  }
+#endif
+  for (; i < num_pixels; i++) {
+    data[i] = color;
+  }
+}
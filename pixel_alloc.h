@@ -0,0 +1,47 @@
+/*
+ * Header file for the pixel buffer allocator
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#ifndef PIXEL_ALLOC_H
+#define PIXEL_ALLOC_H
+
+#include <stdint.h>
+
+// Pixel buffers of images created by init_image and read_image come
+// from this allocator. Every buffer is aligned to PIXEL_BUFFER_ALIGN
+// bytes, so vector kernels can use aligned loads and stores at the
+// start of each row of a block or of a packed image. Buffers of at
+// least PIXEL_HUGE_PAGE_SIZE bytes are aligned to a huge page and the
+// kernel is asked to back them with transparent huge pages, which
+// reduces TLB misses and the number of page faults when they are first
+// written. Freed buffers are kept in a small pool and handed out again
+// to the next allocation of the same size, so replacing an image with
+// one of the same size doesn't fault in fresh pages.
+//
+// Buffers may also be released with free() (bypassing the pool).
+
+#define PIXEL_BUFFER_ALIGN    64
+#define PIXEL_HUGE_PAGE_SIZE  (2U << 20)
+
+// Allocate a buffer for num_pixels pixels. The contents are undefined.
+//
+// Returns:
+//   a pointer to the buffer, or NULL if it could not be allocated
+uint32_t *pixel_buffer_alloc(uint64_t num_pixels);
+
+// Release a buffer returned by pixel_buffer_alloc for num_pixels
+// pixels, keeping it in the pool if there is room. Does nothing if
+// data is NULL.
+void pixel_buffer_free(uint32_t *data, uint64_t num_pixels);
+
+// Free every buffer held by the pool.
+void pixel_buffer_pool_release(void);
+
+// Store color in each of num_pixels pixels starting at data, using
+// vector stores (which bypass the cache for large buffers).
+void pixel_buffer_fill(uint32_t *data, uint64_t num_pixels, uint32_t color);
+
+#endif // PIXEL_ALLOC_H
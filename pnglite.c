@@ -4,6 +4,10 @@
 #define DO_CRC_CHECKS 1
 #define USE_ZLIB 1
 
+/* largest count given to zlib at once, and size of the IDAT chunks written */
+#define PNG_ZLIB_MAX_AVAIL	0x40000000U
+#define PNG_IDAT_CHUNK_SIZE	0x10000U
+
 #if USE_ZLIB
 #include <zlib.h>
 #else
@@ -325,7 +329,7 @@ int png_close_file(png_t* png)
 	return PNG_NO_ERROR;
 }
 
-static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
+static int png_init_deflate(png_t* png)
 {
 	z_stream *stream;
 	png->zs = png_alloc(sizeof(z_stream));
@@ -340,8 +344,10 @@ static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
 	if(deflateInit(stream, Z_DEFAULT_COMPRESSION) != Z_OK)
 		return PNG_ZLIB_ERROR;
 
-	stream->next_in = data;
-	stream->avail_in = datalen;
+	/* compressed data is collected in readbuf, which is written out as
+	   an IDAT chunk whenever it fills */
+	stream->next_out = png->readbuf;
+	stream->avail_out = png->readbuflen;
 
 	return PNG_NO_ERROR;
 }
@@ -372,7 +378,7 @@ static int png_init_inflate(png_t* png)
 #endif
 
 	stream->next_out = png->png_data;
-	stream->avail_out = png->png_datalen;
+	stream->avail_out = 0;	/* set by png_inflate */
 
 	return PNG_NO_ERROR;
 }
@@ -417,6 +423,8 @@ static int png_end_inflate(png_t* png)
 	return PNG_NO_ERROR;
 }
 
+static int png_unfilter_row(png_t* png);
+
 static int png_inflate(png_t* png, unsigned char* data, int len)
 {
 	int result;
@@ -432,17 +440,38 @@ static int png_inflate(png_t* png, unsigned char* data, int len)
 	stream->next_in = data;
 	stream->avail_in = len;
 
+	/* the output buffer holds one filtered row, which is unfiltered and
+	   passed on as soon as it is complete. a row may be larger than
+	   zlib's 32-bit counts, so give it to zlib at most
+	   PNG_ZLIB_MAX_AVAIL bytes at a time */
+	do
+	{
+		size_t left = png->png_datalen - (size_t)(stream->next_out - png->png_data);
+		if(stream->avail_out == 0 && png->next_row < png->height)
+			stream->avail_out = (left < PNG_ZLIB_MAX_AVAIL) ? (uInt)left : PNG_ZLIB_MAX_AVAIL;
+
 #if USE_ZLIB
-	result = inflate(stream, Z_SYNC_FLUSH);
+		result = inflate(stream, Z_SYNC_FLUSH);
 #else
-	result = z_inflate(stream);
+		result = z_inflate(stream);
 #endif
 
-	if(result != Z_STREAM_END && result != Z_OK)
-	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
+		if(result != Z_STREAM_END && result != Z_OK)
+		{
+			printf("%s\n", stream->msg);
+			return PNG_ZLIB_ERROR;
+		}
+
+		if((size_t)(stream->next_out - png->png_data) == png->png_datalen)
+		{
+			int row_result = png_unfilter_row(png);
+			if(row_result != PNG_NO_ERROR)
+				return row_result;
+			stream->next_out = png->png_data;
+			stream->avail_out = 0;
+		}
 	}
+	while(stream->avail_in != 0 && result != Z_STREAM_END);
 
 	if(stream->avail_in != 0)
 		return PNG_ZLIB_ERROR;
@@ -450,7 +479,22 @@ static int png_inflate(png_t* png, unsigned char* data, int len)
 	return PNG_NO_ERROR;
 }
 
-static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
+static int png_write_chunk(png_t* png, const char* type, unsigned char* data, unsigned length)
+{
+	unsigned long crc = crc32(0L, (const unsigned char *)type, 4);
+	/* (crc32 with a null pointer returns the initial value) */
+	if(length)
+		crc = crc32(crc, data, length);
+
+	file_write_ul(png, length);
+	file_write(png, (void*)type, 1, 4);
+	file_write(png, data, 1, length);
+	file_write_ul(png, crc);
+
+	return PNG_NO_ERROR;
+}
+
+static int png_deflate(png_t* png, unsigned char* data, size_t len, int flush)
 {
 	int result;
 
@@ -459,51 +503,41 @@ static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
 	if(!stream)
 		return PNG_MEMORY_ERROR;
 
-	stream->next_out = (unsigned char*)outdata;
-	stream->avail_out = outlen;
-
-	result = deflate(stream, Z_SYNC_FLUSH);
-
-	*outwritten = outlen - stream->avail_out;
-
-	if(result != Z_STREAM_END && result != Z_OK)
+	/* data larger than zlib's 32-bit counts is given to zlib at most
+	   PNG_ZLIB_MAX_AVAIL bytes at a time. deflate stops when it runs
+	   out of input or fills the output buffer, which is then written
+	   as one IDAT chunk */
+	for(;;)
 	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
-	}
-
-	return result;
-}
+		uInt avail = (len < PNG_ZLIB_MAX_AVAIL) ? (uInt)len : PNG_ZLIB_MAX_AVAIL;
 
-static int png_write_idats(png_t* png, unsigned char* data)
-{
-	unsigned char *chunk;
-	unsigned long written;
-	unsigned long crc;
-	unsigned size = png->width * png->height * png->bpp + png->height;
-	unsigned chunk_size = compressBound(size);
+		stream->next_in = data;
+		stream->avail_in = avail;
 
-	(void)png_init_deflate;
-	(void)png_end_deflate;
-	(void)png_deflate;
+		result = deflate(stream, (len > avail) ? Z_NO_FLUSH : flush);
 
-	chunk = png_alloc(chunk_size + 4);
-	memcpy(chunk, "IDAT", 4);
+		if(result != Z_STREAM_END && result != Z_OK && result != Z_BUF_ERROR)
+		{
+			printf("%s\n", stream->msg);
+			return PNG_ZLIB_ERROR;
+		}
 
-	written = chunk_size;
-	compress(chunk+4, &written, data, size);
+		data += avail - stream->avail_in;
+		len -= avail - stream->avail_in;
 
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, chunk, written+4);
-	set_ul(chunk+written+4, crc);
-	file_write_ul(png, written);
-	file_write(png, chunk, 1, written+8);
-	png_free(chunk);
+		if(stream->avail_out == 0)
+		{
+			png_write_chunk(png, "IDAT", png->readbuf, png->readbuflen);
+			stream->next_out = png->readbuf;
+			stream->avail_out = png->readbuflen;
+		}
+		else if(len == 0 && (flush != Z_FINISH || result == Z_STREAM_END))
+			break;
+	}
 
-	file_write_ul(png, 0);
-	file_write(png, "IEND", 1, 4);
-	crc = crc32(0L, (const unsigned char *)"IEND", 4);
-	file_write_ul(png, crc);
+	/* the last chunk may be shorter */
+	if(flush == Z_FINISH && stream->avail_out != png->readbuflen)
+		png_write_chunk(png, "IDAT", png->readbuf, png->readbuflen - stream->avail_out);
 
 	return PNG_NO_ERROR;
 }
@@ -566,9 +600,9 @@ static int png_process_chunk(png_t* png)
 
 	if(type == *(unsigned int*)"IDAT")	/* if we found an idat, all other idats should be followed with no other chunks in between */
 	{
-		if(!png->png_data) /* first IDAT */
+		if(!png->png_data) /* first IDAT: allocate a filtered row */
 		{
-			png->png_datalen = png->width * png->height * png->bpp + png->height;
+			png->png_datalen = (size_t)png->width * png->bpp + 1;
 			png->png_data = png_alloc(png->png_datalen);
 		}
 
@@ -596,25 +630,25 @@ static int png_process_chunk(png_t* png)
 	return result;
 }
 
-static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
+static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, size_t len)
 {
-	int i;
+	size_t i;
 	unsigned char a = 0;
 
 	for(i = 0; i < len; i++)
 	{
-		if(i >= stride)
+		if(i >= (size_t)stride)
 			a = out[i - stride];
 
 		out[i] = in[i] + a;
 	}
 }
 
-static void png_filter_up(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+static void png_filter_up(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, size_t len)
 {
 	(void) stride;
 
-	int i;
+	size_t i;
 
 	if(prev_line)
 	{
@@ -625,9 +659,9 @@ static void png_filter_up(int stride, unsigned char* in, unsigned char* out, uns
 		memcpy(out, in, len);
 }
 
-static void png_filter_average(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+static void png_filter_average(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, size_t len)
 {
-	int i;
+	size_t i;
 	unsigned char a = 0;
 	unsigned char b = 0;
 	unsigned int sum = 0;
@@ -637,7 +671,7 @@ static void png_filter_average(int stride, unsigned char* in, unsigned char* out
 		if(prev_line)
 			b = prev_line[i];
 
-		if(i >= stride)
+		if(i >= (size_t)stride)
 			a = out[i - stride];
 
 		sum = a;
@@ -666,16 +700,16 @@ static unsigned char png_paeth(unsigned char a, unsigned char b, unsigned char c
 	return (char)pr;
 }
 
-static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, size_t len)
 {
-	int i;
+	size_t i;
 	unsigned char a;
 	unsigned char b;
 	unsigned char c;
 
 	for(i = 0; i < len; i++)
 	{
-		if(prev_line && i >= stride)
+		if(prev_line && i >= (size_t)stride)
 		{
 			a = out[i - stride];
 			b = prev_line[i];
@@ -688,7 +722,7 @@ static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out,
 			else
 				b = 0;
 
-			if(i >= stride)
+			if(i >= (size_t)stride)
 				a = out[i - stride];
 			else
 				a = 0;
@@ -700,87 +734,84 @@ static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out,
 	}
 }
 
-static int png_filter(png_t* png, unsigned char* data)
-{
-	(void) png;
-	(void) data;
-	return PNG_NO_ERROR;
-}
-
-static int png_unfilter(png_t* png, unsigned char* data)
+static int png_unfilter_row(png_t* png)
 {
-	unsigned i;
-	unsigned pos = 0;
-	unsigned outpos = 0;
-	unsigned char *filtered = png->png_data;
+	size_t i;
+	unsigned char *filtered = png->png_data + 1;
+	unsigned char filter = png->png_data[0];
+	unsigned char *out = png->row_data[0];
+	unsigned char *prev_line = png->next_row ? png->row_data[1] : 0;
 
 	int stride = png->bpp;
+	size_t row_bytes = png->png_datalen - 1;
 
-	while(pos < png->png_datalen)
-	{
-		unsigned char filter = filtered[pos];
-
-		pos++;
+	if(png->next_row >= png->height)
+		return PNG_ZLIB_ERROR;
 
-		if(png->depth == 16)
+	if(png->depth == 16)
+	{
+		for(i = 0; i < row_bytes; i+=2)
 		{
-			for(i = 0; i < png->width * stride; i+=2)
-			{
-				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
-			}
-		}
-
-		switch(filter)
-		{
-		case 0: /* none */
-			memcpy(data+outpos, filtered+pos, png->width * stride);
-			break;
-		case 1: /* sub */
-			png_filter_sub(stride, filtered+pos, data+outpos, png->width * stride);
-			break;
-		case 2: /* up */
-			if(outpos)
-				png_filter_up(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_up(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 3: /* average */
-			if(outpos)
-				png_filter_average(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_average(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 4: /* paeth */
-			if(outpos)
-				png_filter_paeth(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_paeth(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		default:
-			return PNG_UNKNOWN_FILTER;
+			*(short*)(filtered+i) = (filtered[i] << 8) | filtered[i+1];
 		}
+	}
 
-		outpos += png->width * stride;
-		pos += png->width * stride;
+	switch(filter)
+	{
+	case 0: /* none */
+		memcpy(out, filtered, row_bytes);
+		break;
+	case 1: /* sub */
+		png_filter_sub(stride, filtered, out, row_bytes);
+		break;
+	case 2: /* up */
+		png_filter_up(stride, filtered, out, prev_line, row_bytes);
+		break;
+	case 3: /* average */
+		png_filter_average(stride, filtered, out, prev_line, row_bytes);
+		break;
+	case 4: /* paeth */
+		png_filter_paeth(stride, filtered, out, prev_line, row_bytes);
+		break;
+	default:
+		return PNG_UNKNOWN_FILTER;
 	}
 
+	png->row_fun(out, png->next_row, png->row_user_pointer);
+
+	/* this row is the previous row of the next one */
+	png->row_data[0] = png->row_data[1];
+	png->row_data[1] = out;
+	png->next_row++;
+
 	return PNG_NO_ERROR;
 }
 
-int png_get_data(png_t* png, unsigned char* data)
+int png_get_rows(png_t* png, png_row_callback_t row_fun, void* user_pointer)
 {
 	int result = PNG_NO_ERROR;
+	size_t row_bytes = (size_t)png->width * png->bpp;
 
 	png->zs = NULL;
 	png->png_datalen = 0;
 	png->png_data = NULL;
 	png->readbuf = NULL;
 	png->readbuflen = 0;
+	png->next_row = 0;
+	png->row_fun = row_fun;
+	png->row_user_pointer = user_pointer;
+	png->row_data[0] = png_alloc(row_bytes + 1);
+	png->row_data[1] = png_alloc(row_bytes + 1);
 
-	while(result == PNG_NO_ERROR)
+	if(png->row_data[0] && png->row_data[1])
 	{
-		result = png_process_chunk(png);
+		while(result == PNG_NO_ERROR)
+		{
+			result = png_process_chunk(png);
+		}
 	}
+	else
+		result = PNG_MEMORY_ERROR;
 
 	if (png->readbuf)
 	{
@@ -792,45 +823,119 @@ int png_get_data(png_t* png, unsigned char* data)
 		png_end_inflate(png);
 	}
 
+	png_free(png->png_data);
+	png_free(png->row_data[0]);
+	png_free(png->row_data[1]);
+
 	if(result != PNG_DONE)
-	{
-		png_free(png->png_data);
 		return result;
-	}
 
-	result = png_unfilter(png, data);
+	/* the image data must not end early */
+	return (png->next_row == png->height) ? PNG_NO_ERROR : PNG_ZLIB_ERROR;
+}
 
-	png_free(png->png_data);
+struct png_data_rows
+{
+	unsigned char* data;
+	size_t row_bytes;
+};
 
-	return result;
+static void png_store_row(const unsigned char* row, unsigned y, void* user_pointer)
+{
+	struct png_data_rows* rows = user_pointer;
+	memcpy(rows->data + y * rows->row_bytes, row, rows->row_bytes);
 }
 
-int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
+int png_get_data(png_t* png, unsigned char* data)
+{
+	struct png_data_rows rows;
+	rows.data = data;
+	rows.row_bytes = (size_t)png->width * png->bpp;
+
+	return png_get_rows(png, png_store_row, &rows);
+}
+
+int png_set_rows(png_t* png, unsigned width, unsigned height, char depth, int color, png_row_source_t row_fun, void* user_pointer)
 {
-	//int i;
-	unsigned i;
-	unsigned char *filtered;
+	int result;
+	unsigned y;
+	size_t row_bytes;
+	/* rows are written unfiltered (filter type 0) */
+	unsigned char filter = 0;
+
 	png->width = width;
 	png->height = height;
 	png->depth = depth;
 	png->color_type = color;
 	png->bpp = png_get_bpp(png);
 
-	filtered = png_alloc(width * height * png->bpp + height);
+	row_bytes = (size_t)width * png->bpp;
+	png->zs = NULL;
+	png->png_datalen = row_bytes;
+	png->png_data = png_alloc(row_bytes ? row_bytes : 1);
+	png->readbuflen = PNG_IDAT_CHUNK_SIZE;
+	png->readbuf = png_alloc(png->readbuflen);
 
-	for(i = 0; i < png->height; i++)
+	if(!png->png_data || !png->readbuf)
+		result = PNG_MEMORY_ERROR;
+	else
+		result = png_init_deflate(png);
+
+	if(result == PNG_NO_ERROR)
 	{
-		filtered[i*png->width*png->bpp+i] = 0;
-		memcpy(&filtered[i*png->width*png->bpp+i+1], data + i * png->width*png->bpp, png->width*png->bpp);
+		png_write_ihdr(png);
+
+		/* each row is produced, then compressed after its filter type
+		   byte, so only one row of samples is ever held in memory */
+		for(y = 0; y < height && result == PNG_NO_ERROR; y++)
+		{
+			row_fun(png->png_data, y, user_pointer);
+			result = png_deflate(png, &filter, 1, Z_NO_FLUSH);
+			if(result == PNG_NO_ERROR)
+				result = png_deflate(png, png->png_data, row_bytes, Z_NO_FLUSH);
+		}
+		if(result == PNG_NO_ERROR)
+			result = png_deflate(png, NULL, 0, Z_FINISH);
+		if(result == PNG_NO_ERROR)
+			png_write_chunk(png, "IEND", NULL, 0);
 	}
 
-	png_filter(png, filtered);
-	png_write_ihdr(png);
-	png_write_idats(png, filtered);
+	if(png->zs)
+		png_end_deflate(png);
 
-	png_free(filtered);
+	png_free(png->png_data);
+	png_free(png->readbuf);
+	png->png_data = NULL;
+	png->readbuf = NULL;
+	png->readbuflen = 0;
 
-	return PNG_NO_ERROR;
+	return result;
+}
+
+struct png_set_data_rows
+{
+	const unsigned char* data;
+	size_t row_bytes;
+};
+
+static void png_load_row(unsigned char* row, unsigned y, void* user_pointer)
+{
+	struct png_set_data_rows* rows = user_pointer;
+	memcpy(row, rows->data + y * rows->row_bytes, rows->row_bytes);
+}
+
+int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
+{
+	struct png_set_data_rows rows;
+	png_t info;
+
+	/* (the row size depends on the bytes per pixel of the format) */
+	info.depth = depth;
+	info.color_type = color;
+	rows.data = data;
+	rows.row_bytes = (size_t)width * png_get_bpp(&info);
+
+	return png_set_rows(png, width, height, depth, color, png_load_row, &rows);
 }
 
 char* png_error_string(int error)
@@ -81,6 +81,8 @@ typedef unsigned (*png_write_callback_t)(void* input, size_t size, size_t numel,
 typedef unsigned (*png_read_callback_t)(void* output, size_t size, size_t numel, void* user_pointer);
 typedef void (*png_free_t)(void* p);
 typedef void * (*png_alloc_t)(size_t s);
+typedef void (*png_row_callback_t)(const unsigned char* row, unsigned y, void* user_pointer);
+typedef void (*png_row_source_t)(unsigned char* row, unsigned y, void* user_pointer);
 
 typedef struct
 {
@@ -90,7 +92,7 @@ typedef struct
 	void*				user_pointer;
 
 	unsigned char*			png_data;
-	unsigned			png_datalen;
+	size_t				png_datalen;
 
 	unsigned			width;
 	unsigned			height;
@@ -103,6 +105,11 @@ typedef struct
 
 	unsigned char*			readbuf;
 	unsigned			readbuflen;
+
+	unsigned char*			row_data[2];	/* current and previous unfiltered rows */
+	unsigned			next_row;
+	png_row_callback_t		row_fun;
+	void*				row_user_pointer;
 } png_t;
 
 /*
@@ -215,8 +222,42 @@ char* png_error_string(int error);
 
 int png_get_data(png_t* png, unsigned char* data);
 
+/*
+	Function: png_get_rows
+
+	This function decodes the opened png file one row at a time, calling row_fun with each row (of width*(bytes per pixel) bytes) as soon as it has been decompressed and unfiltered, in order from the top row. Only two rows are kept in memory, so the decoded image is never stored as a whole. The row passed to row_fun is only valid until it returns.
+
+	Parameters:
+		row_fun - Function called with each row, its index and user_pointer.
+		user_pointer - Passed to row_fun.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_get_rows(png_t* png, png_row_callback_t row_fun, void* user_pointer);
+
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
+/*
+	Function: png_set_rows
+
+	This function writes a png image to the opened png file one row at a time, calling row_fun to produce each row (of width*(bytes per pixel) bytes) in order from the top row. Each row is compressed as soon as it has been produced and the compressed data is written in fixed-size IDAT chunks, so only one row and one chunk are kept in memory.
+
+	Parameters:
+		width - Width of the image.
+		height - Height of the image.
+		depth - Bit depth of the samples.
+		color - Color type of the image.
+		row_fun - Function called to fill in each row, given its index and user_pointer.
+		user_pointer - Passed to row_fun.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_set_rows(png_t* png, unsigned width, unsigned height, char depth, int color, png_row_source_t row_fun, void* user_pointer);
+
 /*
 	Function: png_close_file
 
@@ -0,0 +1,470 @@
+/*
+ * Implementation of the sprite alpha-run analysis cache
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sprite_runs.h"
+
+// number of slots in the hash table (a power of 2), and the
+// maximum number of analyses kept before the cache is flushed
+#define CACHE_SLOTS        1024
+#define CACHE_MAX_ENTRIES  (CACHE_SLOTS * 3 / 4)
+
+// maximum number of distinct spritemaps with cached analyses
+#define MAX_SOURCES        64
+
+// protects all of the cache state
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct SpriteRuns *cache[CACHE_SLOTS];
+static unsigned cache_entries;
+
+// pixel buffers of the spritemaps which have cached analyses (as the
+// range of pixels each spritemap uses, since views of the same pixels
+// have different buffers), so that
+// invalidating an image which was never used as a spritemap is cheap.
+// every drawing function invalidates its dest image, so when there are
+// no sources at all this is checked without taking the lock.
+struct SourceBuffer {
+  const uint32_t *data, *data_end;
+};
+static struct SourceBuffer sources[MAX_SOURCES];
+static unsigned num_sources;
+
+// the set the calling thread has entered, if any
+static __thread const struct SpriteRunsSet *thread_set;
+
+/*
+ * finds the end of the part of an image's pixel buffer that the image
+ * uses (the pixel after the last pixel of its last row)
+ */
+static const uint32_t *buffer_end(const struct Image *img) {
+  if (img->width == 0 || img->height == 0) {
+    return img->data;
+  }
+  return img->data + image_pixel_index(img, img->width - 1, img->height - 1) + 1;
+}
+
+/*
+ * determines whether two ranges of pixels overlap
+ */
+static int buffers_overlap(const uint32_t *begin1, const uint32_t *end1,
+                           const uint32_t *begin2, const uint32_t *end2) {
+  return begin1 < end2 && begin2 < end1;
+}
+
+/*
+ * computes a hash of a spritemap/region pair
+ */
+static unsigned region_hash(const uint32_t *data, const struct Rect *rect) {
+  uint64_t h = (uint64_t) (uintptr_t) data;
+  h = (h ^ (uint32_t) rect->x) * 0x100000001B3ULL;
+  h = (h ^ (uint32_t) rect->y) * 0x100000001B3ULL;
+  h = (h ^ (uint32_t) rect->width) * 0x100000001B3ULL;
+  h = (h ^ (uint32_t) rect->height) * 0x100000001B3ULL;
+  return (unsigned) (h ^ (h >> 29));
+}
+
+/*
+ * computes the hash table slot for a spritemap/region pair
+ */
+static unsigned cache_hash(const uint32_t *data, const struct Rect *rect) {
+  return region_hash(data, rect) & (CACHE_SLOTS - 1);
+}
+
+/*
+ * determines whether a cached analysis was computed for the
+ * given spritemap and region
+ */
+static int cache_matches(const struct SpriteRuns *runs, struct Image *img, const struct Rect *rect) {
+  return runs->data == img->data
+      && runs->img_width == img->width
+      && runs->img_height == img->height
+      && runs->img_stride == img->stride
+      && runs->img_flags == img->flags
+      && runs->rect.x == rect->x
+      && runs->rect.y == rect->y
+      && runs->rect.width == rect->width
+      && runs->rect.height == rect->height;
+}
+
+static void free_sprite_runs(struct SpriteRuns *runs) {
+  free(runs->row_start);
+  free(runs->runs);
+  free(runs);
+}
+
+/*
+ * removes an analysis from the cache, freeing it unless it is still
+ * in use (in which case the last release_sprite_runs frees it).
+ * the cache lock must be held.
+ */
+static void evict_sprite_runs(struct SpriteRuns *runs) {
+  if (runs->refs == 0) {
+    free_sprite_runs(runs);
+  } else {
+    runs->evicted = 1;
+  }
+}
+
+/*
+ * removes every analysis from the cache. the cache lock must be held.
+ */
+static void flush_cache(void) {
+  for (unsigned i = 0; i < CACHE_SLOTS; i++) {
+    if (cache[i] != NULL) {
+      evict_sprite_runs(cache[i]);
+      cache[i] = NULL;
+    }
+  }
+  cache_entries = 0;
+  __atomic_store_n(&num_sources, 0, __ATOMIC_RELAXED);
+}
+
+void clear_sprite_runs(void) {
+  pthread_mutex_lock(&cache_lock);
+  flush_cache();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void invalidate_sprite_runs(struct Image *img) {
+  if (__atomic_load_n(&num_sources, __ATOMIC_RELAXED) == 0) {
+    return;
+  }
+  const uint32_t *begin = img->data, *end = buffer_end(img);
+  // (the dest image of the thread's set was invalidated with the set)
+  if (thread_set != NULL && begin >= thread_set->dest_begin && end <= thread_set->dest_end) {
+    return;
+  }
+  pthread_mutex_lock(&cache_lock);
+  int found = 0;
+  unsigned n = num_sources;
+  for (unsigned i = 0; i < n; ) {
+    if (buffers_overlap(sources[i].data, sources[i].data_end, begin, end)) {
+      sources[i] = sources[--n];
+      found = 1;
+    } else {
+      i++;
+    }
+  }
+  if (found) {
+    // removing entries from an open addressing table would break
+    // probe sequences, so just rebuild the table without them
+    struct SpriteRuns *keep[CACHE_SLOTS];
+    unsigned num_keep = 0;
+    for (unsigned j = 0; j < CACHE_SLOTS; j++) {
+      if (cache[j] != NULL) {
+        if (buffers_overlap(cache[j]->data, cache[j]->data_end, begin, end)) {
+          evict_sprite_runs(cache[j]);
+        } else {
+          keep[num_keep++] = cache[j];
+        }
+        cache[j] = NULL;
+      }
+    }
+    for (unsigned j = 0; j < num_keep; j++) {
+      unsigned slot = cache_hash(keep[j]->data, &keep[j]->rect);
+      while (cache[slot] != NULL) {
+        slot = (slot + 1) & (CACHE_SLOTS - 1);
+      }
+      cache[slot] = keep[j];
+    }
+    cache_entries = num_keep;
+    __atomic_store_n(&num_sources, n, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * appends a run to the run list being built, merging it with the
+ * previous run of the same row if it has the same type
+ */
+static void append_run(uint32_t *runs, uint32_t *num_runs, uint32_t row_start, uint32_t type) {
+  if (*num_runs > row_start && SPRITE_RUN_TYPE(runs[*num_runs - 1]) == type) {
+    runs[*num_runs - 1]++;
+  } else {
+    runs[(*num_runs)++] = (type << 30) | 1;
+  }
+}
+
+/*
+ * computes the run analysis of a sprite region
+ */
+static struct SpriteRuns *analyze_sprite(struct Image *img, const struct Rect *rect) {
+  struct SpriteRuns *result = (struct SpriteRuns *) calloc(1, sizeof(struct SpriteRuns));
+  if (result == NULL) {
+    return NULL;
+  }
+  result->data = img->data;
+  result->img_width = img->width;
+  result->img_height = img->height;
+  result->img_stride = img->stride;
+  result->img_flags = img->flags;
+  result->data_end = buffer_end(img);
+  result->rect = *rect;
+  result->row_start = (uint32_t *) malloc((rect->height + 1) * sizeof(uint32_t));
+  // there can never be more runs than pixels
+  result->runs = (uint32_t *) malloc((size_t) rect->width * rect->height * sizeof(uint32_t));
+  if (result->row_start == NULL || result->runs == NULL) {
+    free_sprite_runs(result);
+    return NULL;
+  }
+
+  uint32_t num_runs = 0;
+  for (int32_t j = 0; j < rect->height; j++) {
+    result->row_start[j] = num_runs;
+    for (int32_t i = 0; i < rect->width; i++) {
+      uint32_t alpha = img->data[image_pixel_index(img, rect->x + i, rect->y + j)] & 255;
+      uint32_t type = (alpha == 0) ? SPRITE_RUN_SKIP : (alpha == 255) ? SPRITE_RUN_COPY : SPRITE_RUN_BLEND;
+      append_run(result->runs, &num_runs, result->row_start[j], type);
+      if (type == SPRITE_RUN_SKIP) {
+        result->num_skip++;
+      } else if (type == SPRITE_RUN_COPY) {
+        result->num_copy++;
+      } else {
+        result->num_blend++;
+      }
+    }
+  }
+  result->row_start[rect->height] = num_runs;
+
+  // give back the memory for runs which were merged
+  uint32_t *shrunk = (uint32_t *) realloc(result->runs, (num_runs > 0 ? num_runs : 1) * sizeof(uint32_t));
+  if (shrunk != NULL) {
+    result->runs = shrunk;
+  }
+  return result;
+}
+
+/*
+ * finds the cached analysis of a sprite region, and takes a reference
+ * to it. the cache lock must be held.
+ *
+ * Returns:
+ *   pointer to the analysis, or NULL if it is not cached
+ *   (in which case *slot is set to the free slot where it belongs)
+ */
+static struct SpriteRuns *find_sprite_runs(struct Image *spritemap, const struct Rect *sprite, unsigned *slot) {
+  *slot = cache_hash(spritemap->data, sprite);
+  while (cache[*slot] != NULL) {
+    if (cache_matches(cache[*slot], spritemap, sprite)) {
+      cache[*slot]->refs++;
+      return cache[*slot];
+    }
+    *slot = (*slot + 1) & (CACHE_SLOTS - 1);
+  }
+  return NULL;
+}
+
+/*
+ * gets an analysis through the cache (the work of get_sprite_runs
+ * for regions outside the thread's set)
+ */
+static const struct SpriteRuns *cache_get_sprite_runs(struct Image *spritemap, const struct Rect *sprite) {
+  unsigned slot;
+  pthread_mutex_lock(&cache_lock);
+  struct SpriteRuns *runs = find_sprite_runs(spritemap, sprite, &slot);
+  pthread_mutex_unlock(&cache_lock);
+  if (runs != NULL) {
+    return runs;
+  }
+
+  // analyze without holding the lock, so other threads can keep drawing
+  struct SpriteRuns *result = analyze_sprite(spritemap, sprite);
+  if (result == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  runs = find_sprite_runs(spritemap, sprite, &slot);
+  if (runs != NULL) {
+    // another thread got there first
+    pthread_mutex_unlock(&cache_lock);
+    free_sprite_runs(result);
+    return runs;
+  }
+
+  // make room if the table is full or there are too many spritemaps
+  int known_source = 0;
+  for (unsigned i = 0; i < num_sources; i++) {
+    if (sources[i].data == result->data && sources[i].data_end == result->data_end) {
+      known_source = 1;
+    }
+  }
+  if (cache_entries >= CACHE_MAX_ENTRIES || (!known_source && num_sources >= MAX_SOURCES)) {
+    flush_cache();
+    known_source = 0;
+    slot = cache_hash(spritemap->data, sprite);
+  }
+  if (!known_source) {
+    sources[num_sources].data = result->data;
+    sources[num_sources].data_end = result->data_end;
+    __atomic_store_n(&num_sources, num_sources + 1, __ATOMIC_RELAXED);
+  }
+
+  result->refs = 1;
+  cache[slot] = result;
+  cache_entries++;
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+const struct SpriteRuns *find_cached_sprite_runs(struct Image *spritemap, const struct Rect *sprite) {
+  // (nothing is cached if no spritemap has an analysis)
+  if (__atomic_load_n(&num_sources, __ATOMIC_RELAXED) == 0) {
+    return NULL;
+  }
+  unsigned slot;
+  pthread_mutex_lock(&cache_lock);
+  struct SpriteRuns *runs = find_sprite_runs(spritemap, sprite, &slot);
+  pthread_mutex_unlock(&cache_lock);
+  return runs;
+}
+
+/*
+ * drops a reference to an analysis taken through the cache
+ */
+static void cache_release_sprite_runs(const struct SpriteRuns *runs) {
+  struct SpriteRuns *r = (struct SpriteRuns *) runs;
+  pthread_mutex_lock(&cache_lock);
+  r->refs--;
+  if (r->evicted && r->refs == 0) {
+    free_sprite_runs(r);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * finds the slot of a set holding a sprite region, taking the region's
+ * analysis from the cache if it isn't kept in the set yet
+ *
+ * Returns:
+ *   pointer to the analysis, or NULL if the region isn't in the set
+ *   (or memory could not be allocated)
+ */
+static const struct SpriteRuns *set_sprite_runs(const struct SpriteRunsSet *set, struct Image *spritemap,
+                                                const struct Rect *sprite) {
+  if (set->num_slots == 0) {
+    return NULL;
+  }
+  unsigned mask = set->num_slots - 1;
+  for (unsigned slot = region_hash(spritemap->data, sprite) & mask; set->slots[slot].spritemap != NULL;
+       slot = (slot + 1) & mask) {
+    struct SpriteRunsSetSlot *entry = &set->slots[slot];
+    if (entry->spritemap != spritemap || memcmp(&entry->rect, sprite, sizeof(struct Rect)) != 0) {
+      continue;
+    }
+    const struct SpriteRuns *runs = __atomic_load_n(&entry->runs, __ATOMIC_ACQUIRE);
+    if (runs == NULL) {
+      // the first thread to need the analysis keeps its reference in the set
+      const struct SpriteRuns *found = cache_get_sprite_runs(spritemap, sprite);
+      if (found == NULL) {
+        return NULL;
+      }
+      if (__atomic_compare_exchange_n(&entry->runs, &runs, found, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        runs = found;
+      } else {
+        cache_release_sprite_runs(found);
+      }
+    }
+    return runs;
+  }
+  return NULL;
+}
+
+/*
+ * determines whether an analysis is kept by a set
+ */
+static int set_holds_runs(const struct SpriteRunsSet *set, const struct SpriteRuns *runs) {
+  if (set->num_slots == 0) {
+    return 0;
+  }
+  unsigned mask = set->num_slots - 1;
+  for (unsigned slot = region_hash(runs->data, &runs->rect) & mask; set->slots[slot].spritemap != NULL;
+       slot = (slot + 1) & mask) {
+    if (__atomic_load_n(&set->slots[slot].runs, __ATOMIC_ACQUIRE) == runs) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const struct SpriteRuns *get_sprite_runs(struct Image *spritemap, const struct Rect *sprite) {
+  if (thread_set != NULL) {
+    const struct SpriteRuns *runs = set_sprite_runs(thread_set, spritemap, sprite);
+    if (runs != NULL) {
+      return runs;
+    }
+  }
+  return cache_get_sprite_runs(spritemap, sprite);
+}
+
+void release_sprite_runs(const struct SpriteRuns *runs) {
+  // (an analysis kept by the thread's set is released with the set)
+  if (thread_set != NULL && set_holds_runs(thread_set, runs)) {
+    return;
+  }
+  cache_release_sprite_runs(runs);
+}
+
+int sprite_runs_set_init(struct SpriteRunsSet *set, struct Image *dest, uint32_t max_sprites) {
+  invalidate_sprite_runs(dest);
+  set->dest_begin = dest->data;
+  set->dest_end = buffer_end(dest);
+  set->slots = NULL;
+  set->num_slots = 0;
+  // (the analyses of a set too large for its table are just looked
+  // up in the cache)
+  if (max_sprites == 0 || max_sprites > (1U << 30)) {
+    return 0;
+  }
+  // keep the table at most half full
+  uint32_t num_slots = 2;
+  while (num_slots < 2 * (uint64_t) max_sprites) {
+    num_slots *= 2;
+  }
+  set->slots = (struct SpriteRunsSetSlot *) calloc(num_slots, sizeof(struct SpriteRunsSetSlot));
+  if (set->slots == NULL) {
+    return -1;
+  }
+  set->num_slots = num_slots;
+  return 0;
+}
+
+void sprite_runs_set_add(struct SpriteRunsSet *set, struct Image *spritemap, const struct Rect *sprite) {
+  if (set->num_slots == 0) {
+    return;
+  }
+  unsigned mask = set->num_slots - 1;
+  unsigned slot = region_hash(spritemap->data, sprite) & mask;
+  while (set->slots[slot].spritemap != NULL) {
+    if (set->slots[slot].spritemap == spritemap
+        && memcmp(&set->slots[slot].rect, sprite, sizeof(struct Rect)) == 0) {
+      return;
+    }
+    slot = (slot + 1) & mask;
+  }
+  set->slots[slot].spritemap = spritemap;
+  set->slots[slot].rect = *sprite;
+  set->slots[slot].runs = NULL;
+}
+
+void sprite_runs_set_cleanup(struct SpriteRunsSet *set) {
+  for (uint32_t i = 0; i < set->num_slots; i++) {
+    if (set->slots[i].runs != NULL) {
+      cache_release_sprite_runs(set->slots[i].runs);
+    }
+  }
+  free(set->slots);
+  set->slots = NULL;
+  set->num_slots = 0;
+}
+
+void enter_sprite_runs_set(const struct SpriteRunsSet *set) {
+  thread_set = set;
+}
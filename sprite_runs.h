@@ -0,0 +1,124 @@
+/*
+ * Header file for the sprite alpha-run analysis cache
+ * CSF Assignment 2
+ * Iris Gupta and Eric Wang
+ * igupta5@jh.edu and ewang42@jhu.edu
+ */
+
+#ifndef SPRITE_RUNS_H
+#define SPRITE_RUNS_H
+
+#include <stdint.h>
+#include "image.h"
+#include "drawing_funcs.h"
+
+// Each row of a sprite is encoded as a sequence of runs of pixels
+// that need the same treatment when the sprite is drawn.
+#define SPRITE_RUN_SKIP   0  // alpha 0: background color is unchanged
+#define SPRITE_RUN_COPY   1  // alpha 255: sprite color replaces background
+#define SPRITE_RUN_BLEND  2  // anything else: must be blended
+
+// A run is stored in a single uint32_t: the run type in the top
+// two bits and the number of pixels in the remaining bits.
+#define SPRITE_RUN_TYPE(run)    ((run) >> 30)
+#define SPRITE_RUN_LENGTH(run)  ((run) & 0x3FFFFFFFU)
+
+// Run analysis of one rectangular region of a spritemap.
+struct SpriteRuns {
+  // cache key
+  const uint32_t *data;
+  uint32_t img_width, img_height, img_stride, img_flags;
+  struct Rect rect;
+
+  // end of the part of the pixel buffer used by the spritemap
+  const uint32_t *data_end;
+
+  // the runs of row j are runs[row_start[j]] .. runs[row_start[j+1]-1]
+  uint32_t *row_start;
+  uint32_t *runs;
+
+  // number of pixels of each run type in the whole region
+  uint64_t num_skip, num_copy, num_blend;
+
+  // number of get_sprite_runs calls not yet matched by
+  // release_sprite_runs, and whether the analysis has been
+  // removed from the cache (it is freed when both are done)
+  uint32_t refs;
+  int evicted;
+};
+
+// All of the functions below may be called from several threads at
+// once, except clear_sprite_runs.
+
+// Get the run analysis of the sprite region of spritemap, computing
+// it on first use and caching it for later calls with the same
+// spritemap and region. The sprite region must lie entirely within
+// the spritemap.
+//
+// Returns:
+//   pointer to the analysis (owned by the cache; valid until it is
+//   passed to release_sprite_runs), or NULL if memory could not be
+//   allocated
+const struct SpriteRuns *get_sprite_runs(struct Image *spritemap, const struct Rect *sprite);
+
+// Like get_sprite_runs, but only return an analysis which is already
+// cached (never computing one).
+//
+// Returns:
+//   pointer to the analysis (to be passed to release_sprite_runs), or
+//   NULL if it isn't cached
+const struct SpriteRuns *find_cached_sprite_runs(struct Image *spritemap, const struct Rect *sprite);
+
+// Indicate that an analysis returned by get_sprite_runs or
+// find_cached_sprite_runs is no longer being used.
+void release_sprite_runs(const struct SpriteRuns *runs);
+
+// Discard all cached analyses of the given image, and of any other
+// image sharing its pixels (such as a view of it, or an image it is
+// a view of). This must be called before the pixels of an image used
+// as a spritemap are modified other than through the drawing
+// functions, and before its pixel data is freed.
+void invalidate_sprite_runs(struct Image *img);
+
+// Discard every cached analysis. No analysis may be in use.
+void clear_sprite_runs(void);
+
+// A set of sprite regions drawn by several threads into one dest
+// image (such as the bands of a display list render). Creating the
+// set invalidates the dest image once. A thread which has entered the
+// set then invalidates images sharing the dest image's pixels, and
+// gets (and releases) the analyses of the set's regions, without
+// taking the cache lock: each region's analysis is looked up in the
+// cache the first time it is needed and then kept in the set. The
+// dest image must not share pixels with any of the spritemaps.
+struct SpriteRunsSetSlot {
+  struct Image *spritemap;
+  struct Rect rect;
+  const struct SpriteRuns *runs;   // NULL until first needed
+};
+
+struct SpriteRunsSet {
+  const uint32_t *dest_begin, *dest_end;
+  struct SpriteRunsSetSlot *slots;  // open addressing hash table
+  uint32_t num_slots;
+};
+
+// Initialize a set for up to max_sprites regions drawn into dest.
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated
+int sprite_runs_set_init(struct SpriteRunsSet *set, struct Image *dest, uint32_t max_sprites);
+
+// Add the sprite region of spritemap to a set (which no thread may
+// have entered yet). The region must lie entirely within the
+// spritemap. Adding a region twice has no effect.
+void sprite_runs_set_add(struct SpriteRunsSet *set, struct Image *spritemap, const struct Rect *sprite);
+
+// Release the analyses kept by a set and free it. No thread may be
+// in the set.
+void sprite_runs_set_cleanup(struct SpriteRunsSet *set);
+
+// Make the calling thread use a set (or no set, if set is NULL).
+void enter_sprite_runs_set(const struct SpriteRunsSet *set);
+
+#endif // SPRITE_RUNS_H
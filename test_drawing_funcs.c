@@ -11,6 +11,12 @@
 #include <string.h>
 #include "image.h"
 #include "drawing_funcs.h"
+#include "blend_kernels.h"
+#include "sprite_runs.h"
+#include "display_list.h"
+#include "atlas.h"
+#include "pixel_alloc.h"
+#include "pnglite.h"
 #include "tctest.h"
 
 // an expected color identified by a (non-zero) character code
@@ -53,6 +59,7 @@ TestObjs *setup(void) {
 
 // clean up test fixture data
 void cleanup(TestObjs *objs) {
+  clear_sprite_runs();
   free(objs->small.data);
   free(objs->large.data);
   free(objs->tilemap.data);
@@ -85,8 +92,10 @@ void check_picture(struct Image *img, Picture *p) {
 // prototypes of test main functions
 void test_draw_pixel(TestObjs *objs);
 void test_draw_rect(TestObjs *objs);
+void test_draw_rect_opaque_transparent(TestObjs *objs);
 void test_draw_circle(TestObjs *objs);
 void test_draw_circle_clip(TestObjs *objs);
+void test_draw_circle_distance_rule(TestObjs *objs);
 void test_draw_tile(TestObjs *objs);
 void test_draw_sprite(TestObjs *objs);
 // prototypes of test helper functions
@@ -102,6 +111,22 @@ void test_blend_colors(TestObjs *objs);
 void test_set_pixel(TestObjs *objs);
 void test_square(TestObjs *objs);
 void test_square_dist(TestObjs *objs);
+void test_blend_span_kernels(TestObjs *objs);
+void test_sprite_runs(TestObjs *objs);
+void test_premultiplied_alpha(TestObjs *objs);
+void test_tiled_layout(TestObjs *objs);
+void test_display_list(TestObjs *objs);
+void test_display_list_parallel(TestObjs *objs);
+void test_display_list_cull(TestObjs *objs);
+void test_dirty_tracking(TestObjs *objs);
+void test_draw_batches(TestObjs *objs);
+void test_image_view(TestObjs *objs);
+void test_atlas_pack(TestObjs *objs);
+void test_draw_shapes_reference(TestObjs *objs);
+void test_init_image_mapped(TestObjs *objs);
+void test_pixel_alloc(TestObjs *objs);
+void test_lazy_clear(TestObjs *objs);
+void test_png_streaming(TestObjs *objs);
 
 
 int main(int argc, char **argv) {
@@ -115,10 +140,12 @@ int main(int argc, char **argv) {
   // TEST() directives for main functions
   TEST(test_draw_pixel);
   TEST(test_draw_rect);
+  TEST(test_draw_rect_opaque_transparent);
   TEST(test_draw_circle);
   TEST(test_draw_circle_clip);
-  //TEST(test_draw_tile);
-  //TEST(test_draw_sprite);
+  TEST(test_draw_circle_distance_rule);
+  TEST(test_draw_tile);
+  TEST(test_draw_sprite);
   // TEST() directives for helper functions
   TEST(test_in_bounds);
   TEST(test_compute_index);
@@ -132,6 +159,22 @@ int main(int argc, char **argv) {
   TEST(test_set_pixel);
   TEST(test_square);
   TEST(test_square_dist);
+  TEST(test_blend_span_kernels);
+  TEST(test_sprite_runs);
+  TEST(test_premultiplied_alpha);
+  TEST(test_tiled_layout);
+  TEST(test_display_list);
+  TEST(test_display_list_parallel);
+  TEST(test_display_list_cull);
+  TEST(test_dirty_tracking);
+  TEST(test_draw_batches);
+  TEST(test_image_view);
+  TEST(test_atlas_pack);
+  TEST(test_draw_shapes_reference);
+  TEST(test_init_image_mapped);
+  TEST(test_pixel_alloc);
+  TEST(test_lazy_clear);
+  TEST(test_png_streaming);
   
   
   TEST_FINI();
@@ -179,6 +222,33 @@ void test_draw_rect(TestObjs *objs) {
   check_picture(&objs->small, &expected);
 }
 
+void test_draw_rect_opaque_transparent(TestObjs *objs) {
+  // make some background pixels partially transparent
+  for (unsigned i = 0; i < SMALL_W * SMALL_H; i += 3) {
+    objs->small.data[i] = 0x40506000U | (i * 5);
+  }
+  uint32_t before[SMALL_W * SMALL_H];
+  memcpy(before, objs->small.data, sizeof(before));
+
+  // a fully transparent rectangle keeps every color, but
+  // (like blend_colors) makes every covered pixel opaque
+  struct Rect all = { .x = -2, .y = -2, .width = 20, .height = 20 };
+  draw_rect(&objs->small, &all, 0xFFFFFF00);
+  for (unsigned i = 0; i < SMALL_W * SMALL_H; i++) {
+    ASSERT(objs->small.data[i] == (before[i] | 0xFFU));
+  }
+
+  // an opaque rectangle replaces the covered pixels
+  struct Rect part = { .x = 5, .y = 3, .width = 10, .height = 10 };
+  draw_rect(&objs->small, &part, 0x102030FF);
+  for (int32_t y = 0; y < SMALL_H; y++) {
+    for (int32_t x = 0; x < SMALL_W; x++) {
+      uint32_t expected = (x >= 5 && y >= 3) ? 0x102030FFU : (before[SMALL_IDX(x, y)] | 0xFFU);
+      ASSERT(objs->small.data[SMALL_IDX(x, y)] == expected);
+    }
+  }
+}
+
 void test_draw_circle(TestObjs *objs) {
   Picture expected = {
     { {' ', 0x000000FF}, {'x', 0x00FF00FF} },
@@ -210,7 +280,30 @@ void test_draw_circle_clip(TestObjs *objs) {
 
   check_picture(&objs->small, &expected);
 }
-/*
+
+void test_draw_circle_distance_rule(TestObjs *objs) {
+  // circles partially or entirely off the image, with zero
+  // and negative radii, must cover exactly the pixels whose
+  // squared distance from the center is at most r^2
+  const int32_t circles[][3] = {
+    { 11, 9, 7 }, { -3, 4, 6 }, { 20, -2, 5 }, { 30, 25, 12 },
+    { 5, 5, 0 }, { 12, 10, -4 }, { 12, 10, 40 }, { -50, 5, 3 },
+  };
+  for (unsigned k = 0; k < sizeof(circles) / sizeof(circles[0]); k++) {
+    int32_t cx = circles[k][0], cy = circles[k][1], r = circles[k][2];
+    for (unsigned i = 0; i < LARGE_W * LARGE_H; i++) {
+      objs->large.data[i] = 0x000000FFU;
+    }
+    draw_circle(&objs->large, cx, cy, r, 0x00FF00FF);
+    for (int32_t y = 0; y < LARGE_H; y++) {
+      for (int32_t x = 0; x < LARGE_W; x++) {
+        uint32_t expected = (square_dist(x, y, cx, cy) <= square(r)) ? 0x00FF00FFU : 0x000000FFU;
+        ASSERT(objs->large.data[y * LARGE_W + x] == expected);
+      }
+    }
+  }
+}
+
 void test_draw_tile(TestObjs *objs) {
   ASSERT(read_image("img/PrtMimi.png", &objs->tilemap) == IMG_SUCCESS);
 
@@ -296,7 +389,6 @@ void test_draw_sprite(TestObjs *objs) {
 
   check_picture(&objs->large, &pic);
 }
-*/
 void test_in_bounds(TestObjs *objs) {
   ASSERT(in_bounds(&objs->small, 0, 0) == 0);
   ASSERT(in_bounds(&objs->small, -1, 0) == 1);
@@ -315,6 +407,13 @@ void test_compute_index(TestObjs *objs) {
   ASSERT(compute_index(&objs->small, 0, 1) == 8);
   ASSERT(compute_index(&objs->small, 1, 1) == 9);
   ASSERT(compute_index(&objs->small, 7, 5) == 47);
+
+  // indices of very large canvases don't fit in 32 bits (no pixel
+  // data is needed to compute them)
+  struct Image huge = { .width = 70000, .height = 70000 };
+  ASSERT(compute_index(&huge, 69999, 69999) == 70000ULL * 70000ULL - 1);
+  huge.flags = IMG_TILED;
+  ASSERT(compute_index(&huge, 0, 69984) == 2188ULL * 2187ULL * 1024ULL);
 }
 
 void test_clamp(TestObjs *objs) {
@@ -440,9 +539,9 @@ void test_blend_colors(TestObjs *objs) {
 }
 
 void test_set_pixel(TestObjs *objs) {
-  uint32_t index1 = compute_index(&objs->small, 3, 2);
-  uint32_t index2 = compute_index(&objs->small, 5, 4);
-  uint32_t index3 = compute_index(&objs->small, 4, 2);
+  uint64_t index1 = compute_index(&objs->small, 3, 2);
+  uint64_t index2 = compute_index(&objs->small, 5, 4);
+  uint64_t index3 = compute_index(&objs->small, 4, 2);
   
   // initially objs->small pixels are opaque black
   ASSERT(objs->small.data[SMALL_IDX(3, 2)] == 0x000000FFU);
@@ -482,3 +581,1083 @@ void test_square_dist(TestObjs *objs) {
   ASSERT(square_dist(3, 0, 0, 4) == 25);
   ASSERT(square_dist(0, 4, 3, 0) == 25);
 }
+
+// simple deterministic pseudo-random number generator for tests
+static uint32_t test_rand(uint32_t *state) {
+  *state = *state * 1103515245U + 12345U;
+  return (*state >> 16) | (*state << 16);
+}
+
+// reference implementation of premultiplied alpha compositing
+static uint32_t premultiplied_over(uint32_t fg, uint32_t bg) {
+  uint32_t inv_alpha = 255 - (fg & 255), result = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    result |= (((fg >> shift) & 255) + ((bg >> shift) & 255) * inv_alpha / 255) << shift;
+  }
+  return result;
+}
+
+void test_blend_span_kernels(TestObjs *objs) {
+  (void) objs;
+  char original_backend[16];
+  strcpy(original_backend, get_blend_backend());
+  uint32_t state = 12345;
+  uint32_t fg[40], bg[40], actual[40];
+
+  // check every backend this CPU supports
+  const char *name;
+  for (unsigned k = 0; (name = get_blend_backend_name(k)) != NULL; k++) {
+    if (set_blend_backend(name) != 0) {
+      continue;
+    }
+    ASSERT(strcmp(get_blend_backend(), name) == 0);
+    for (unsigned trial = 0; trial < 64; trial++) {
+      // cover every run length up to 40 (exercising the vector
+      // loops and the scalar tails) and every alpha value
+      size_t n = trial % 41;
+      for (size_t i = 0; i < n; i++) {
+        fg[i] = test_rand(&state);
+        bg[i] = test_rand(&state);
+      }
+
+      uint32_t color = (test_rand(&state) & 0xFFFFFF00U) | ((trial * 4 + k) & 255);
+      memcpy(actual, bg, sizeof(bg));
+      blend_span_color(actual, color, n);
+      for (size_t i = 0; i < n; i++) {
+        ASSERT(actual[i] == blend_colors(color, bg[i]));
+      }
+
+      memcpy(actual, bg, sizeof(bg));
+      blend_span_pixels(actual, fg, n);
+      for (size_t i = 0; i < n; i++) {
+        ASSERT(actual[i] == blend_colors(fg[i], bg[i]));
+      }
+
+      // premultiplied kernels: every component is fg + bg*(255-alpha)/255
+      for (size_t i = 0; i < n; i++) {
+        fg[i] = premultiply_color(fg[i]);
+      }
+      memcpy(actual, bg, sizeof(bg));
+      blend_span_pixels_premultiplied(actual, fg, n);
+      for (size_t i = 0; i < n; i++) {
+        ASSERT(actual[i] == premultiplied_over(fg[i], bg[i]));
+      }
+      memcpy(actual, bg, sizeof(bg));
+      blend_span_color_premultiplied(actual, premultiply_color(color), n);
+      for (size_t i = 0; i < n; i++) {
+        ASSERT(actual[i] == premultiplied_over(premultiply_color(color), bg[i]));
+      }
+
+      // sample conversions: RGB and RGBA bytes to pixels and back
+      uint8_t bytes[40 * 4];
+      for (size_t i = 0; i < n * 4; i++) {
+        bytes[i] = (uint8_t) test_rand(&state);
+      }
+      rgb_to_pixels(actual, bytes, n);
+      for (size_t i = 0; i < n; i++) {
+        ASSERT(actual[i] == (((uint32_t) bytes[i * 3] << 24) | ((uint32_t) bytes[i * 3 + 1] << 16)
+                             | ((uint32_t) bytes[i * 3 + 2] << 8) | 0xFFU));
+      }
+      rgba_to_pixels(actual, bytes, n);
+      for (size_t i = 0; i < n; i++) {
+        ASSERT(actual[i] == (((uint32_t) bytes[i * 4] << 24) | ((uint32_t) bytes[i * 4 + 1] << 16)
+                             | ((uint32_t) bytes[i * 4 + 2] << 8) | bytes[i * 4 + 3]));
+      }
+      // (and in place, as write_image does)
+      memcpy(fg, actual, sizeof(fg));
+      pixels_to_rgba((uint8_t *) actual, actual, n);
+      ASSERT(memcmp(actual, bytes, n * 4) == 0);
+      rgba_to_pixels(actual, (const uint8_t *) actual, n);
+      ASSERT(memcmp(actual, fg, n * sizeof(uint32_t)) == 0);
+    }
+
+    // extreme component values for every alpha
+    for (uint32_t alpha = 0; alpha < 256; alpha++) {
+      for (size_t i = 0; i < 16; i++) {
+        fg[i] = ((i & 1) ? 0xFFFFFF00U : 0x00000000U) | alpha;
+        bg[i] = (i & 2) ? 0xFFFFFFFFU : 0x00000000U;
+      }
+      memcpy(actual, bg, sizeof(bg));
+      blend_span_pixels(actual, fg, 16);
+      for (size_t i = 0; i < 16; i++) {
+        ASSERT(actual[i] == blend_colors(fg[i], bg[i]));
+      }
+    }
+  }
+
+  ASSERT(set_blend_backend("no-such-backend") == -1);
+  ASSERT(set_blend_backend(original_backend) == 0);
+}
+
+void test_sprite_runs(TestObjs *objs) {
+  // row 2 of objs->small: transparent, transparent, opaque, opaque,
+  // opaque, translucent, transparent, opaque
+  const uint32_t row[SMALL_W] = {
+    0x11111100, 0x22222200, 0x333333FF, 0x444444FF,
+    0x555555FF, 0x66666680, 0x77777700, 0x888888FF,
+  };
+  memcpy(&objs->small.data[SMALL_IDX(0, 2)], row, sizeof(row));
+
+  struct Rect r = { .x = 0, .y = 2, .width = SMALL_W, .height = 2 };
+  const struct SpriteRuns *runs = get_sprite_runs(&objs->small, &r);
+  ASSERT(runs != NULL);
+  ASSERT(runs->row_start[0] == 0);
+  ASSERT(runs->row_start[1] == 5);
+  ASSERT(runs->row_start[2] == 6);
+  ASSERT(runs->runs[0] == ((SPRITE_RUN_SKIP << 30) | 2));
+  ASSERT(runs->runs[1] == ((SPRITE_RUN_COPY << 30) | 3));
+  ASSERT(runs->runs[2] == ((SPRITE_RUN_BLEND << 30) | 1));
+  ASSERT(runs->runs[3] == ((SPRITE_RUN_SKIP << 30) | 1));
+  ASSERT(runs->runs[4] == ((SPRITE_RUN_COPY << 30) | 1));
+  // row 3 is still opaque black
+  ASSERT(SPRITE_RUN_TYPE(runs->runs[5]) == SPRITE_RUN_COPY);
+  ASSERT(SPRITE_RUN_LENGTH(runs->runs[5]) == SMALL_W);
+  ASSERT(runs->num_skip == 3);
+  ASSERT(runs->num_copy == 12);
+  ASSERT(runs->num_blend == 1);
+
+  // the analysis is cached
+  ASSERT(get_sprite_runs(&objs->small, &r) == runs);
+  ASSERT(runs->refs == 2);
+  release_sprite_runs(runs);
+
+  // after invalidation, changes to the pixels are seen (and the old
+  // analysis stays valid until it is released)
+  objs->small.data[SMALL_IDX(0, 3)] = 0x12345678;
+  invalidate_sprite_runs(&objs->small);
+  ASSERT(runs->evicted && runs->num_blend == 1);
+  release_sprite_runs(runs);
+  runs = get_sprite_runs(&objs->small, &r);
+  ASSERT(runs != NULL);
+  ASSERT(runs->num_blend == 2);
+  ASSERT(runs->runs[5] == ((SPRITE_RUN_BLEND << 30) | 1));
+  release_sprite_runs(runs);
+
+  // a thread in a set keeps the set's analyses (taking one reference
+  // for the set), and doesn't invalidate them when drawing on the dest
+  struct Image dest;
+  ASSERT(init_image(&dest, 16, 16) == IMG_SUCCESS);
+  struct SpriteRunsSet set;
+  ASSERT(sprite_runs_set_init(&set, &dest, 2) == 0);
+  sprite_runs_set_add(&set, &objs->small, &r);
+  sprite_runs_set_add(&set, &objs->small, &r);
+  enter_sprite_runs_set(&set);
+  runs = get_sprite_runs(&objs->small, &r);
+  ASSERT(runs != NULL && runs->num_blend == 2);
+  ASSERT(get_sprite_runs(&objs->small, &r) == runs);
+  ASSERT(runs->refs == 1);
+  release_sprite_runs(runs);
+  release_sprite_runs(runs);
+  ASSERT(runs->refs == 1);
+  draw_pixel(&dest, 1, 1, 0xFFFFFFFF);
+  ASSERT(!runs->evicted);
+  enter_sprite_runs_set(NULL);
+  sprite_runs_set_cleanup(&set);
+  ASSERT(runs->refs == 0);
+  free_image(&dest);
+}
+
+void test_premultiplied_alpha(TestObjs *objs) {
+  ASSERT(premultiply_color(0xFF804080) == 0x80402080);
+  ASSERT(unpremultiply_color(0x80402080) == 0xFF804080);
+  ASSERT(premultiply_color(0x123456FF) == 0x123456FF);
+  ASSERT(unpremultiply_color(0x00000000) == 0x00000000);
+
+  if (!(drawing_supported_flags() & IMG_PREMULTIPLIED)) {
+    return;
+  }
+
+  struct Image img;
+  set_new_image_flags(IMG_PREMULTIPLIED);
+  int rc = init_image(&img, SMALL_W, SMALL_H);
+  set_new_image_flags(0);
+  ASSERT(rc == IMG_SUCCESS);
+  ASSERT(img.flags & IMG_PREMULTIPLIED);
+  ASSERT(!(objs->small.flags & IMG_PREMULTIPLIED));
+
+  // on an opaque background, results match straight alpha to within 1
+  struct Rect r = { .x = 1, .y = 1, .width = 4, .height = 3 };
+  draw_rect(&img, &r, 0xFF0000FF);
+  draw_rect(&objs->small, &r, 0xFF0000FF);
+  draw_circle(&img, 3, 2, 2, 0x20C0E060);
+  draw_circle(&objs->small, 3, 2, 2, 0x20C0E060);
+  for (unsigned i = 0; i < SMALL_W * SMALL_H; i++) {
+    uint32_t actual = img.data[i], expected = objs->small.data[i];
+    ASSERT(get_a(actual) == 255);
+    ASSERT(abs(get_r(actual) - get_r(expected)) <= 1);
+    ASSERT(abs(get_g(actual) - get_g(expected)) <= 1);
+    ASSERT(abs(get_b(actual) - get_b(expected)) <= 1);
+  }
+
+  // a transparent color leaves even translucent pixels unchanged
+  img.data[0] = 0x20100840;
+  struct Rect all = { .x = 0, .y = 0, .width = SMALL_W, .height = SMALL_H };
+  uint32_t before[SMALL_W * SMALL_H];
+  memcpy(before, img.data, sizeof(before));
+  draw_rect(&img, &all, 0xFFFFFF00);
+  ASSERT(memcmp(before, img.data, sizeof(before)) == 0);
+
+  // compositing onto a translucent pixel accumulates coverage
+  draw_pixel(&img, 0, 0, 0x00000080);
+  ASSERT(img.data[0] == 0x0F07039F);
+
+  // a straight alpha sprite wider than one conversion chunk blends
+  // like the same sprite stored premultiplied
+  struct Image straight, converted, a, b;
+  ASSERT(init_image(&straight, 600, 2) == IMG_SUCCESS);
+  set_new_image_flags(IMG_PREMULTIPLIED);
+  ASSERT(init_image(&converted, 600, 2) == IMG_SUCCESS);
+  ASSERT(init_image(&a, 600, 2) == IMG_SUCCESS);
+  ASSERT(init_image(&b, 600, 2) == IMG_SUCCESS);
+  set_new_image_flags(0);
+  for (unsigned i = 0; i < 600 * 2; i++) {
+    straight.data[i] = (i * 0x9E3779B1U) | (i % 3 == 0 ? 0xFF : 0x00) | (i % 3 == 1 ? 0x40 : 0x00);
+    converted.data[i] = premultiply_color(straight.data[i]);
+    a.data[i] = b.data[i] = premultiply_color((i * 0x85EBCA6BU) | 0x80);
+  }
+  struct Rect wide = { .x = 0, .y = 0, .width = 600, .height = 2 };
+  draw_sprite(&a, 3, 0, &straight, &wide);
+  draw_sprite(&b, 3, 0, &converted, &wide);
+  ASSERT(memcmp(a.data, b.data, 600 * 2 * sizeof(uint32_t)) == 0);
+  invalidate_sprite_runs(&straight);
+  invalidate_sprite_runs(&converted);
+  free_image(&straight);
+  free_image(&converted);
+  free_image(&a);
+  free_image(&b);
+
+  free(img.data);
+}
+
+void test_tiled_layout(TestObjs *objs) {
+  // a 70x40 image has 3x2 blocks, the ones at the edges padded
+  struct Image tiled = { .width = 70, .height = 40, .flags = IMG_TILED };
+  ASSERT(image_num_pixels(&tiled) == 6 * 32 * 32);
+  ASSERT(compute_index(&tiled, 0, 0) == 0);
+  ASSERT(compute_index(&tiled, 31, 0) == 31);
+  ASSERT(compute_index(&tiled, 0, 1) == 32);
+  ASSERT(compute_index(&tiled, 32, 0) == 1024);
+  ASSERT(compute_index(&tiled, 69, 39) == 5 * 1024 + 7 * 32 + 5);
+  ASSERT(image_contiguous_pixels(&tiled, 30, 10) == 2);
+  ASSERT(image_contiguous_pixels(&objs->small, 30, 10) == 10);
+
+  if (!(drawing_supported_flags() & IMG_TILED)) {
+    return;
+  }
+
+  // drawing on a tiled image gives the same pixels as on a linear one
+  struct Image linear, spritemap;
+  set_new_image_flags(IMG_TILED);
+  int rc = init_image(&tiled, 70, 40);
+  set_new_image_flags(0);
+  ASSERT(rc == IMG_SUCCESS);
+  ASSERT(tiled.flags == IMG_TILED);
+  ASSERT(init_image(&linear, 70, 40) == IMG_SUCCESS);
+  ASSERT(init_image(&spritemap, 40, 40) == IMG_SUCCESS);
+  uint32_t state = 1;
+  for (unsigned i = 0; i < 40 * 40; i++) {
+    spritemap.data[i] = test_rand(&state);
+  }
+
+  struct Image *images[] = { &tiled, &linear };
+  for (unsigned k = 0; k < 2; k++) {
+    struct Rect r = { .x = 20, .y = 5, .width = 45, .height = 30 };
+    struct Rect src = { .x = 3, .y = 2, .width = 36, .height = 35 };
+    draw_rect(images[k], &r, 0x40C08080);
+    draw_circle(images[k], 33, 30, 15, 0xC02040FF);
+    draw_pixel(images[k], 69, 39, 0x123456FF);
+    draw_tile(images[k], 40, -6, &spritemap, &src);
+    draw_sprite(images[k], -3, 10, &spritemap, &src);
+  }
+  for (int32_t y = 0; y < 40; y++) {
+    for (int32_t x = 0; x < 70; x++) {
+      ASSERT(tiled.data[compute_index(&tiled, x, y)] == linear.data[compute_index(&linear, x, y)]);
+    }
+  }
+
+  free(tiled.data);
+  free(linear.data);
+  invalidate_sprite_runs(&spritemap);
+  free(spritemap.data);
+}
+
+void test_display_list(TestObjs *objs) {
+  struct Image spritemap;
+  ASSERT(init_image(&spritemap, 40, 40) == IMG_SUCCESS);
+  uint32_t state = 7;
+  for (unsigned i = 0; i < 40 * 40; i++) {
+    spritemap.data[i] = test_rand(&state);
+  }
+  struct Rect src = { .x = 2, .y = 1, .width = 37, .height = 38 };
+  struct Rect rects[] = {
+    { .x = 5, .y = 20, .width = 30, .height = 100 },
+    { .x = -10, .y = 60, .width = 100, .height = 8 },
+    { .x = 60, .y = 0, .width = 10, .height = 10 },     // entirely off the canvas
+    { .x = 0, .y = INT32_MIN, .width = 10, .height = INT32_MAX },
+  };
+
+  // with and without tiling, deferred drawing in 32-row bands must
+  // give exactly the same result as immediate drawing
+  uint32_t layouts[] = { 0, IMG_TILED };
+  for (unsigned l = 0; l < 2; l++) {
+    if ((drawing_supported_flags() & layouts[l]) != layouts[l]) {
+      continue;
+    }
+    struct Image immediate, deferred;
+    struct DisplayList dl;
+    set_new_image_flags(layouts[l]);
+    ASSERT(init_image(&immediate, 50, 150) == IMG_SUCCESS);
+    ASSERT(init_image(&deferred, 50, 150) == IMG_SUCCESS);
+    set_new_image_flags(0);
+    display_list_init(&dl);
+
+    for (unsigned i = 0; i < sizeof(rects) / sizeof(rects[0]); i++) {
+      draw_rect(&immediate, &rects[i], 0x8040C0A0 + i);
+      ASSERT(display_list_add_rect(&dl, &rects[i], 0x8040C0A0 + i) == 0);
+    }
+    draw_circle(&immediate, 25, 70, 40, 0x20E0408F);
+    ASSERT(display_list_add_circle(&dl, 25, 70, 40, 0x20E0408F) == 0);
+    draw_circle(&immediate, 10, 140, -12, 0xFFFFFFFF);
+    ASSERT(display_list_add_circle(&dl, 10, 140, -12, 0xFFFFFFFF) == 0);
+    draw_sprite(&immediate, 20, 25, &spritemap, &src);
+    ASSERT(display_list_add_sprite(&dl, 20, 25, &spritemap, &src) == 0);
+    draw_tile(&immediate, -5, 120, &spritemap, &src);
+    ASSERT(display_list_add_tile(&dl, -5, 120, &spritemap, &src) == 0);
+    draw_sprite(&immediate, 0, 90, &spritemap, &src);
+    ASSERT(display_list_add_sprite(&dl, 0, 90, &spritemap, &src) == 0);
+    ASSERT(dl.num_cmds == 9);
+    ASSERT(dl.cmds[2].box.max_x == 70);
+
+    ASSERT(display_list_render(&dl, &deferred, 20) == 0);
+    ASSERT(dl.num_cmds == 0);
+    ASSERT(memcmp(immediate.data, deferred.data, image_num_pixels(&immediate) * sizeof(uint32_t)) == 0);
+
+    display_list_cleanup(&dl);
+    free(immediate.data);
+    free(deferred.data);
+  }
+
+  ASSERT(display_list_band_height(objs->small.width) % IMG_BLOCK_SIZE == 0);
+  ASSERT(display_list_band_height(1U << 30) == IMG_BLOCK_SIZE);
+
+  invalidate_sprite_runs(&spritemap);
+  free(spritemap.data);
+}
+
+void test_display_list_parallel(TestObjs *objs) {
+  struct Image spritemap, immediate, parallel;
+  struct DisplayList dl;
+  ASSERT(init_image(&spritemap, 40, 40) == IMG_SUCCESS);
+  ASSERT(init_image(&immediate, 64, 400) == IMG_SUCCESS);
+  ASSERT(init_image(&parallel, 64, 400) == IMG_SUCCESS);
+  display_list_init(&dl);
+  uint32_t state = 11;
+  for (unsigned i = 0; i < 40 * 40; i++) {
+    spritemap.data[i] = test_rand(&state);
+  }
+
+  // random overlapping commands, drawn with 4 threads in 32-row bands
+  // (most of them near the top, so the threads have to steal bands)
+  for (unsigned i = 0; i < 200; i++) {
+    int32_t x = (int32_t) (test_rand(&state) % 80) - 10;
+    int32_t y = (int32_t) (test_rand(&state) % ((i % 4 == 0) ? 420 : 100)) - 10;
+    int32_t w = (int32_t) (test_rand(&state) % 30) + 1;
+    uint32_t color = test_rand(&state);
+    struct Rect src = { .x = (int32_t) (test_rand(&state) % 10), .y = 3, .width = w, .height = 30 };
+    if (i % 3 == 0) {
+      struct Rect r = { .x = x, .y = y, .width = w, .height = 50 };
+      draw_rect(&immediate, &r, color);
+      ASSERT(display_list_add_rect(&dl, &r, color) == 0);
+    } else if (i % 3 == 1) {
+      draw_circle(&immediate, x, y, w, color);
+      ASSERT(display_list_add_circle(&dl, x, y, w, color) == 0);
+    } else {
+      draw_sprite(&immediate, x, y, &spritemap, &src);
+      ASSERT(display_list_add_sprite(&dl, x, y, &spritemap, &src) == 0);
+    }
+  }
+  ASSERT(display_list_render_parallel(&dl, &parallel, 32, 4) == 0);
+  ASSERT(memcmp(immediate.data, parallel.data, 64 * 400 * sizeof(uint32_t)) == 0);
+
+  // with more threads than bands, and the default band height
+  struct Rect all = { .x = 0, .y = 0, .width = 64, .height = 400 };
+  draw_rect(&immediate, &all, 0x10203040);
+  ASSERT(display_list_add_rect(&dl, &all, 0x10203040) == 0);
+  ASSERT(display_list_render_parallel(&dl, &parallel, 0, 50) == 0);
+  ASSERT(memcmp(immediate.data, parallel.data, 64 * 400 * sizeof(uint32_t)) == 0);
+
+  // commands for a canvas with no pixels are discarded
+  struct Image empty = { .width = 0, .height = 0, .data = NULL, .flags = 0 };
+  ASSERT(display_list_add_rect(&dl, &all, 0x10203040) == 0);
+  ASSERT(display_list_render_parallel(&dl, &empty, 0, 4) == 0);
+  ASSERT(dl.num_cmds == 0);
+
+  display_list_cleanup(&dl);
+  free(immediate.data);
+  free(parallel.data);
+  invalidate_sprite_runs(&spritemap);
+  free(spritemap.data);
+  (void) objs;
+}
+
+void test_display_list_cull(TestObjs *objs) {
+  struct Image immediate, culled;
+  struct DisplayList dl;
+  struct DisplayCullStats stats = { 0, 0, 0, 0 };
+  ASSERT(init_image(&immediate, 40, 40) == IMG_SUCCESS);
+  ASSERT(init_image(&culled, 40, 40) == IMG_SUCCESS);
+  display_list_init(&dl);
+
+  struct Rect rects[] = {
+    { .x = 0, .y = 0, .width = 40, .height = 40 },   // 0: only rows 20-29 visible
+    { .x = 5, .y = 5, .width = 20, .height = 30 },   // 1: only rows 20-29 visible
+    { .x = 0, .y = -5, .width = 40, .height = 25 },  // 2: opaque, rows 0-19
+    { .x = 10, .y = 25, .width = 10, .height = 5 },  // 3: translucent, so it hides nothing
+    { .x = 0, .y = 30, .width = 40, .height = 30 },  // 4: opaque, rows 30-39
+  };
+  uint32_t colors[] = { 0x102030FF, 0x80808080, 0xFF0000FF, 0x00FF0040, 0x0000FFFF };
+  for (unsigned i = 0; i < 5; i++) {
+    if (i == 4) {
+      // hidden by rect 4, and off the canvas
+      draw_circle(&immediate, 20, 35, 3, 0xFFFFFFFF);
+      ASSERT(display_list_add_circle(&dl, 20, 35, 3, 0xFFFFFFFF) == 0);
+      ASSERT(display_list_add_circle(&dl, 100, 30, 5, 0xFFFFFFFF) == 0);
+    }
+    draw_rect(&immediate, &rects[i], colors[i]);
+    ASSERT(display_list_add_rect(&dl, &rects[i], colors[i]) == 0);
+  }
+  ASSERT(display_list_cull(&dl, &culled, &stats) == 0);
+  ASSERT(stats.commands_in == 7);
+  ASSERT(stats.commands_dropped == 2);
+  ASSERT(stats.commands_clipped == 2);
+  ASSERT(stats.pixels_culled == 30 * 40 + 20 * 20 + 7 * 7);
+  ASSERT(dl.num_cmds == 5);
+  ASSERT(dl.cmds[0].rect.y == 20 && dl.cmds[0].rect.height == 10);
+  ASSERT(dl.cmds[1].rect.x == 5 && dl.cmds[1].rect.y == 20 && dl.cmds[1].rect.height == 10);
+  ASSERT(display_list_render(&dl, &culled, 0) == 0);
+  ASSERT(memcmp(immediate.data, culled.data, 40 * 40 * sizeof(uint32_t)) == 0);
+
+  // tiles always hide what is below them, and sprites hide what is
+  // below their opaque pixels
+  struct Image spritemap;
+  ASSERT(init_image(&spritemap, 8, 8) == IMG_SUCCESS);
+  for (unsigned i = 0; i < 8; i++) {
+    spritemap.data[i] = 0x12345600;                  // row 0 is transparent
+  }
+  struct Rect whole = { .x = 0, .y = 0, .width = 8, .height = 8 };
+  struct Rect bad = { .x = 4, .y = 0, .width = 8, .height = 8 };
+  struct Rect small = { .x = 2, .y = 2, .width = 4, .height = 4 };
+  ASSERT(display_list_add_rect(&dl, &small, 0xFFFFFFFF) == 0);     // hidden by the sprite
+  ASSERT(display_list_add_rect(&dl, &whole, 0xFFFFFFFF) == 0);     // only row 0 is visible
+  ASSERT(display_list_add_circle(&dl, 20, 20, 3, 0xFFFFFFFF) == 0); // hidden by the tile
+  ASSERT(display_list_add_sprite(&dl, 0, 0, &spritemap, &whole) == 0);
+  ASSERT(display_list_add_tile(&dl, 16, 16, &spritemap, &whole) == 0);
+  ASSERT(display_list_add_tile(&dl, 0, 0, &spritemap, &bad) == 0); // draws nothing
+  memset(&stats, 0, sizeof(stats));
+  ASSERT(display_list_cull(&dl, &culled, &stats) == 0);
+  ASSERT(stats.commands_dropped == 3);
+  ASSERT(stats.commands_clipped == 1);
+  ASSERT(dl.num_cmds == 3);
+  ASSERT(dl.cmds[0].rect.y == 0 && dl.cmds[0].rect.height == 1);
+  ASSERT(dl.cmds[1].type == DL_SPRITE);
+  display_list_cleanup(&dl);
+
+  // a tile whose source region is invalid draws nothing, even where
+  // clipping off its hidden rows would make the region valid
+  struct Rect tall = { .x = 0, .y = 4, .width = 8, .height = 8 };
+  struct Rect below = { .x = 0, .y = 28, .width = 40, .height = 12 };
+  display_list_init(&dl);
+  draw_tile(&immediate, 0, 24, &spritemap, &tall);
+  draw_rect(&immediate, &below, 0x102030FF);
+  ASSERT(display_list_add_tile(&dl, 0, 24, &spritemap, &tall) == 0);
+  ASSERT(display_list_add_rect(&dl, &below, 0x102030FF) == 0);
+  memset(&stats, 0, sizeof(stats));
+  ASSERT(display_list_cull(&dl, &culled, &stats) == 0);
+  ASSERT(stats.commands_dropped == 1);
+  ASSERT(stats.commands_clipped == 0);
+  ASSERT(display_list_render(&dl, &culled, 0) == 0);
+  ASSERT(memcmp(immediate.data, culled.data, 40 * 40 * sizeof(uint32_t)) == 0);
+
+  display_list_cleanup(&dl);
+  invalidate_sprite_runs(&spritemap);
+  free(spritemap.data);
+  free(immediate.data);
+  free(culled.data);
+  (void) objs;
+}
+
+void test_dirty_tracking(TestObjs *objs) {
+  struct Rect rects[4];
+
+  // an image whose changes aren't tracked is entirely dirty
+  ASSERT(objs->small.dirty == NULL);
+  ASSERT(image_get_dirty_rects(&objs->small, rects, 4) == 1);
+  ASSERT(rects[0].x == 0 && rects[0].y == 0 && rects[0].width == SMALL_W && rects[0].height == SMALL_H);
+
+  // a 100x70 image has 4x3 tiles, the ones at the edges partial
+  struct Image img;
+  ASSERT(init_image(&img, 100, 70) == IMG_SUCCESS);
+  ASSERT(image_enable_dirty_tracking(&img) == IMG_SUCCESS);
+  ASSERT(image_get_dirty_rects(&img, rects, 4) == 0);
+
+  struct Rect r = { .x = 40, .y = 40, .width = 60, .height = 10 };
+  draw_pixel(&img, 5, 5, 0xFFFFFFFF);
+  draw_pixel(&img, 100, 5, 0xFFFFFFFF);
+  draw_rect(&img, &r, 0xFF000080);
+  draw_circle(&img, 99, 69, 2, 0x00FF00FF);
+  draw_circle(&img, -10, 20, 3, 0x00FF00FF);
+  ASSERT(image_get_dirty_rects(&img, rects, 4) == 3);
+  ASSERT(rects[0].x == 0 && rects[0].y == 0 && rects[0].width == 32 && rects[0].height == 32);
+  ASSERT(rects[1].x == 32 && rects[1].y == 32 && rects[1].width == 68 && rects[1].height == 32);
+  ASSERT(rects[2].x == 96 && rects[2].y == 64 && rects[2].width == 4 && rects[2].height == 6);
+  ASSERT(image_get_dirty_rects(&img, rects, 1) == 3);
+
+  // tiles dirty in consecutive rows are merged
+  image_clear_dirty(&img);
+  ASSERT(image_get_dirty_rects(&img, rects, 4) == 0);
+  struct Rect column = { .x = 0, .y = -10, .width = 10, .height = 100 };
+  draw_rect(&img, &column, 0xFFFFFFFF);
+  ASSERT(image_get_dirty_rects(&img, rects, 4) == 1);
+  ASSERT(rects[0].x == 0 && rects[0].y == 0 && rects[0].width == 32 && rects[0].height == 70);
+
+  // drawing a display list marks the bounding boxes of its commands
+  struct DisplayList dl;
+  display_list_init(&dl);
+  image_clear_dirty(&img);
+  ASSERT(display_list_add_rect(&dl, &r, 0xFF000080) == 0);
+  ASSERT(display_list_add_circle(&dl, 10, 10, 2, 0xFF000080) == 0);
+  ASSERT(display_list_render(&dl, &img, 32) == 0);
+  ASSERT(image_get_dirty_rects(&img, rects, 4) == 2);
+  ASSERT(rects[0].x == 0 && rects[0].y == 0 && rects[0].width == 32 && rects[0].height == 32);
+  ASSERT(rects[1].x == 32 && rects[1].y == 32 && rects[1].width == 68 && rects[1].height == 32);
+  display_list_cleanup(&dl);
+
+  image_disable_dirty_tracking(&img);
+  ASSERT(img.dirty == NULL);
+  free(img.data);
+}
+
+void test_draw_batches(TestObjs *objs) {
+  struct Image single, batch, spritemap;
+  ASSERT(init_image(&single, 50, 40) == IMG_SUCCESS);
+  ASSERT(init_image(&batch, 50, 40) == IMG_SUCCESS);
+  ASSERT(init_image(&spritemap, 16, 16) == IMG_SUCCESS);
+  uint32_t state = 3;
+  for (unsigned i = 0; i < 16 * 16; i++) {
+    spritemap.data[i] = test_rand(&state);
+  }
+
+  // overlapping translucent items, some off the image, some with
+  // source regions outside the spritemap, and repeated regions
+  struct Rect rects[20];
+  int32_t xs[20], ys[20];
+  uint32_t colors[20];
+  for (unsigned i = 0; i < 20; i++) {
+    xs[i] = (int32_t) (test_rand(&state) % 70) - 10;
+    ys[i] = (int32_t) (test_rand(&state) % 60) - 10;
+    colors[i] = test_rand(&state);
+    rects[i].x = (int32_t) (test_rand(&state) % 10);
+    rects[i].y = (i % 3 == 0) ? 2 : (int32_t) (test_rand(&state) % 12);
+    rects[i].width = (i % 3 == 0) ? 6 : (int32_t) (test_rand(&state) % 8) + 1;
+    rects[i].height = (i % 3 == 0) ? 6 : (int32_t) (test_rand(&state) % 8) + 1;
+  }
+  for (unsigned i = 0; i < 20; i++) {
+    struct Rect r = { .x = xs[i], .y = ys[i], .width = rects[i].width * 3, .height = rects[i].height * 3 };
+    draw_rect(&single, &r, colors[i]);
+  }
+  for (unsigned i = 0; i < 20; i++) {
+    draw_sprite(&single, xs[i], ys[i], &spritemap, &rects[i]);
+  }
+  for (unsigned i = 0; i < 20; i++) {
+    draw_tile(&single, ys[i], xs[i], &spritemap, &rects[i]);
+  }
+
+  struct Rect scaled[20];
+  for (unsigned i = 0; i < 20; i++) {
+    scaled[i].x = xs[i];
+    scaled[i].y = ys[i];
+    scaled[i].width = rects[i].width * 3;
+    scaled[i].height = rects[i].height * 3;
+  }
+  draw_rects(&batch, scaled, colors, 20);
+  draw_sprites(&batch, xs, ys, &spritemap, rects, 20);
+  draw_tiles(&batch, ys, xs, &spritemap, rects, 20);
+  draw_rects(&batch, NULL, NULL, 0);
+  ASSERT(memcmp(single.data, batch.data, 50 * 40 * sizeof(uint32_t)) == 0);
+
+  // sprites drawn onto their own spritemap, each one changing the
+  // source of the next (whose pixels are mostly transparent or opaque)
+  struct Image self_single, self_batch;
+  ASSERT(init_image(&self_single, 16, 16) == IMG_SUCCESS);
+  ASSERT(init_image(&self_batch, 16, 16) == IMG_SUCCESS);
+  for (unsigned i = 0; i < 16 * 16; i++) {
+    uint32_t pixel = test_rand(&state);
+    uint32_t alpha = (pixel & 3) == 0 ? 0x80 : (pixel & 1) ? 0xFF : 0x00;
+    self_single.data[i] = self_batch.data[i] = (pixel & 0xFFFFFF00U) | alpha;
+  }
+  struct Rect same[4] = {
+    { .x = 0, .y = 0, .width = 8, .height = 8 }, { .x = 0, .y = 0, .width = 8, .height = 8 },
+    { .x = 0, .y = 0, .width = 8, .height = 8 }, { .x = 0, .y = 0, .width = 8, .height = 8 },
+  };
+  int32_t self_xs[4] = { 3, 5, 1, 6 }, self_ys[4] = { 2, 4, 6, 1 };
+  for (unsigned i = 0; i < 4; i++) {
+    draw_sprite(&self_single, self_xs[i], self_ys[i], &self_single, &same[i]);
+  }
+  draw_sprites(&self_batch, self_xs, self_ys, &self_batch, same, 4);
+  ASSERT(memcmp(self_single.data, self_batch.data, 16 * 16 * sizeof(uint32_t)) == 0);
+  invalidate_sprite_runs(&self_single);
+  invalidate_sprite_runs(&self_batch);
+  free(self_single.data);
+  free(self_batch.data);
+
+  free(single.data);
+  free(batch.data);
+  invalidate_sprite_runs(&spritemap);
+  free(spritemap.data);
+  (void) objs;
+}
+
+void test_image_view(TestObjs *objs) {
+  struct Image parent, offset, view;
+  ASSERT(init_image(&parent, 40, 30) == IMG_SUCCESS);
+  ASSERT(init_image(&offset, 40, 30) == IMG_SUCCESS);
+
+  // drawing on a view is drawing on the parent, offset and clipped
+  // to the view's region
+  ASSERT(image_view(&view, &parent, 5, 7, 20, 10) == IMG_SUCCESS);
+  ASSERT(view.width == 20 && view.height == 10 && view.stride == 40);
+  ASSERT(view.data == parent.data + 7 * 40 + 5);
+  struct Rect r = { .x = -3, .y = 2, .width = 10, .height = 20 };
+  draw_rect(&view, &r, 0xFF000080);
+  draw_circle(&view, 18, 5, 4, 0x00FF00FF);
+  draw_pixel(&view, 19, 9, 0x0000FFFF);
+  draw_pixel(&view, 20, 9, 0x0000FFFF);
+
+  struct Rect r2 = { .x = 5, .y = 9, .width = 7, .height = 8 };
+  draw_rect(&offset, &r2, 0xFF000080);
+  for (int32_t y = 7; y < 17; y++) {
+    for (int32_t x = 5; x < 25; x++) {
+      int32_t dx = x - 23, dy = y - 12;
+      if (dx * dx + dy * dy <= 16) {
+        draw_pixel(&offset, x, y, 0x00FF00FF);
+      }
+    }
+  }
+  draw_pixel(&offset, 24, 16, 0x0000FFFF);
+  ASSERT(memcmp(parent.data, offset.data, 40 * 30 * sizeof(uint32_t)) == 0);
+
+  // invalid regions
+  ASSERT(image_view(&view, &parent, 30, 0, 11, 5) == IMG_ERR_INVALID_VIEW);
+  ASSERT(image_view(&view, &parent, 0, 25, 5, 6) == IMG_ERR_INVALID_VIEW);
+  ASSERT(image_view(&view, &parent, 41, 0, 0, 0) == IMG_ERR_INVALID_VIEW);
+  ASSERT(image_view(&view, &parent, 40, 30, 0, 0) == IMG_SUCCESS);
+
+  // views of views
+  struct Image inner;
+  ASSERT(image_view(&view, &parent, 5, 7, 20, 10) == IMG_SUCCESS);
+  ASSERT(image_view(&inner, &view, 2, 3, 4, 4) == IMG_SUCCESS);
+  ASSERT(inner.data == parent.data + 10 * 40 + 7 && inner.stride == 40);
+  ASSERT(compute_index(&inner, 1, 2) == 2 * 40 + 1);
+
+  // a sprite drawn from a view of a spritemap is the same as the
+  // corresponding region of the spritemap, including after the
+  // spritemap changes (so views and their parents share invalidation)
+  struct Image spritemap, sprites, dst1, dst2;
+  ASSERT(init_image(&spritemap, 24, 24) == IMG_SUCCESS);
+  ASSERT(init_image(&dst1, 30, 30) == IMG_SUCCESS);
+  ASSERT(init_image(&dst2, 30, 30) == IMG_SUCCESS);
+  uint32_t state = 5;
+  for (unsigned i = 0; i < 24 * 24; i++) {
+    spritemap.data[i] = test_rand(&state);
+  }
+  ASSERT(image_view(&sprites, &spritemap, 8, 4, 12, 16) == IMG_SUCCESS);
+  for (int pass = 0; pass < 2; pass++) {
+    struct Rect s1 = { .x = 1, .y = 2, .width = 10, .height = 12 };
+    struct Rect s2 = { .x = 9, .y = 6, .width = 10, .height = 12 };
+    draw_sprite(&dst1, 3, 4, &sprites, &s1);
+    draw_sprite(&dst2, 3, 4, &spritemap, &s2);
+    draw_tile(&dst1, 15, 14, &sprites, &s1);
+    draw_tile(&dst2, 15, 14, &spritemap, &s2);
+    ASSERT(memcmp(dst1.data, dst2.data, 30 * 30 * sizeof(uint32_t)) == 0);
+    struct Rect change = { .x = 0, .y = 0, .width = 24, .height = 12 };
+    draw_rect(&spritemap, &change, 0x12345678);
+  }
+  invalidate_sprite_runs(&spritemap);
+
+  // views of tiled images must start at a block boundary
+  set_new_image_flags(IMG_TILED);
+  struct Image tiled, tiled_offset;
+  ASSERT(init_image(&tiled, 70, 40) == IMG_SUCCESS);
+  ASSERT(init_image(&tiled_offset, 70, 40) == IMG_SUCCESS);
+  set_new_image_flags(0);
+  ASSERT(image_view(&view, &tiled, 5, 0, 10, 10) == IMG_ERR_INVALID_VIEW);
+  ASSERT(image_view(&view, &tiled, 32, 0, 38, 40) == IMG_SUCCESS);
+  ASSERT(view.stride == 96 && (view.flags & IMG_TILED));
+  struct Rect r3 = { .x = 2, .y = 30, .width = 50, .height = 5 };
+  draw_rect(&view, &r3, 0x808080FF);
+  draw_pixel(&view, 37, 39, 0xFFFFFFFF);
+  struct Rect r4 = { .x = 34, .y = 30, .width = 36, .height = 5 };
+  draw_rect(&tiled_offset, &r4, 0x808080FF);
+  draw_pixel(&tiled_offset, 69, 39, 0xFFFFFFFF);
+  ASSERT(memcmp(tiled.data, tiled_offset.data, image_num_pixels(&tiled) * sizeof(uint32_t)) == 0);
+
+  free(parent.data);
+  free(offset.data);
+  free(spritemap.data);
+  free(dst1.data);
+  free(dst2.data);
+  free(tiled.data);
+  free(tiled_offset.data);
+  (void) objs;
+}
+
+void test_atlas_pack(TestObjs *objs) {
+  const uint32_t layouts[] = { 0, IMG_TILED };
+  const uint32_t sizes[][2] = { { 17, 5 }, { 40, 33 }, { 1, 1 }, { 64, 8 }, { 9, 30 } };
+  for (unsigned l = 0; l < 2; l++) {
+    set_new_image_flags(layouts[l]);
+    struct Image images[5], copies[5], atlas;
+    struct Image *ptrs[6];
+    uint32_t state = 11;
+    for (unsigned i = 0; i < 5; i++) {
+      ASSERT(init_image(&images[i], sizes[i][0], sizes[i][1]) == IMG_SUCCESS);
+      ASSERT(init_image(&copies[i], sizes[i][0], sizes[i][1]) == IMG_SUCCESS);
+      for (uint32_t y = 0; y < sizes[i][1]; y++) {
+        for (uint32_t x = 0; x < sizes[i][0]; x++) {
+          uint32_t color = test_rand(&state);
+          images[i].data[image_pixel_index(&images[i], x, y)] = color;
+          copies[i].data[image_pixel_index(&copies[i], x, y)] = color;
+        }
+      }
+      ptrs[i] = &images[i];
+    }
+    ptrs[5] = NULL;
+    uint32_t *old_data[5];
+    for (unsigned i = 0; i < 5; i++) {
+      old_data[i] = images[i].data;
+    }
+    ASSERT(atlas_pack(&atlas, ptrs, 6) == 0);
+
+    // every image is a view of its own region of the atlas, with the
+    // same pixels as before
+    for (unsigned i = 0; i < 5; i++) {
+      free(old_data[i]);
+      ASSERT(images[i].width == sizes[i][0] && images[i].height == sizes[i][1]);
+      uint64_t offset = (uint64_t) (images[i].data - atlas.data);
+      ASSERT(offset < image_num_pixels(&atlas));
+      if (layouts[l] & IMG_TILED) {
+        ASSERT((offset & (IMG_BLOCK_SIZE * IMG_BLOCK_SIZE - 1)) == 0);
+      }
+      for (uint32_t y = 0; y < sizes[i][1]; y++) {
+        for (uint32_t x = 0; x < sizes[i][0]; x++) {
+          ASSERT(images[i].data[image_pixel_index(&images[i], x, y)]
+                 == copies[i].data[image_pixel_index(&copies[i], x, y)]);
+        }
+      }
+    }
+
+    // so the views must not overlap: filling each view with its own
+    // color leaves every view uniformly colored
+    for (unsigned i = 0; i < 5; i++) {
+      for (uint32_t y = 0; y < sizes[i][1]; y++) {
+        for (uint32_t x = 0; x < sizes[i][0]; x++) {
+          images[i].data[image_pixel_index(&images[i], x, y)] = i;
+        }
+      }
+    }
+    for (unsigned i = 0; i < 5; i++) {
+      for (uint32_t y = 0; y < sizes[i][1]; y++) {
+        for (uint32_t x = 0; x < sizes[i][0]; x++) {
+          ASSERT(images[i].data[image_pixel_index(&images[i], x, y)] == i);
+        }
+      }
+      free(copies[i].data);
+    }
+    free(atlas.data);
+  }
+
+  // images with different flags can't be packed together
+  struct Image a, b, atlas;
+  set_new_image_flags(IMG_TILED);
+  ASSERT(init_image(&a, 4, 4) == IMG_SUCCESS);
+  set_new_image_flags(0);
+  ASSERT(init_image(&b, 4, 4) == IMG_SUCCESS);
+  struct Image *mixed[2] = { &a, &b };
+  uint32_t *a_data = a.data;
+  ASSERT(atlas_pack(&atlas, mixed, 2) == -1);
+  ASSERT(a.data == a_data);
+  free(a.data);
+  free(b.data);
+  (void) objs;
+}
+
+void test_draw_shapes_reference(TestObjs *objs) {
+  // rectangles and circles (many off the image, some with negative
+  // sizes) must blend exactly the pixels a per-pixel loop would, in
+  // both layouts
+  const uint32_t layouts[] = { 0, IMG_TILED };
+  for (unsigned l = 0; l < 2; l++) {
+    set_new_image_flags(layouts[l]);
+    struct Image img;
+    ASSERT(init_image(&img, 45, 37) == IMG_SUCCESS);
+    set_new_image_flags(0);
+    uint32_t expected[45 * 37];
+    for (unsigned i = 0; i < 45 * 37; i++) {
+      expected[i] = 0x000000FFU;
+    }
+    uint32_t state = 17;
+    for (unsigned n = 0; n < 60; n++) {
+      int32_t x = (int32_t) (test_rand(&state) % 80) - 20;
+      int32_t y = (int32_t) (test_rand(&state) % 70) - 20;
+      int32_t a = (int32_t) (test_rand(&state) % 50) - 5;
+      int32_t b = (int32_t) (test_rand(&state) % 50) - 5;
+      uint32_t color = test_rand(&state);
+      if (n % 5 == 0) {
+        color |= 0xFF;
+      }
+      if (n % 2 == 0) {
+        struct Rect r = { .x = x, .y = y, .width = a, .height = b };
+        draw_rect(&img, &r, color);
+        for (int32_t j = 0; j < 37; j++) {
+          for (int32_t i = 0; i < 45; i++) {
+            if (i >= x && i < x + a && j >= y && j < y + b) {
+              expected[j * 45 + i] = blend_colors(color, expected[j * 45 + i]);
+            }
+          }
+        }
+      } else {
+        draw_circle(&img, x, y, a - 10, color);
+        for (int32_t j = 0; j < 37; j++) {
+          for (int32_t i = 0; i < 45; i++) {
+            if (square_dist(i, j, x, y) <= square(a - 10)) {
+              expected[j * 45 + i] = blend_colors(color, expected[j * 45 + i]);
+            }
+          }
+        }
+      }
+    }
+    for (uint32_t j = 0; j < 37; j++) {
+      for (uint32_t i = 0; i < 45; i++) {
+        ASSERT(img.data[image_pixel_index(&img, i, j)] == expected[j * 45 + i]);
+      }
+    }
+    free(img.data);
+  }
+  (void) objs;
+}
+
+void test_init_image_mapped(TestObjs *objs) {
+  (void) objs;
+  // a canvas in a temporary file
+  struct Image mapped;
+  ASSERT(init_image_mapped(&mapped, 70, 40, NULL) == IMG_SUCCESS);
+  ASSERT(mapped.mapped_size == 70 * 40 * sizeof(uint32_t));
+  ASSERT(mapped.data[0] == 0x000000FFU);
+  ASSERT(mapped.data[70 * 40 - 1] == 0x000000FFU);
+  struct Rect r = { .x = 10, .y = 5, .width = 20, .height = 30 };
+  draw_rect(&mapped, &r, 0x11223380U);
+  ASSERT(mapped.data[image_pixel_index(&mapped, 10, 5)] == blend_colors(0x11223380U, 0x000000FFU));
+  ASSERT(mapped.data[image_pixel_index(&mapped, 9, 5)] == 0x000000FFU);
+  free_image(&mapped);
+  ASSERT(mapped.data == NULL);
+
+  // a tiled canvas in a named file, which holds the pixel buffer
+  const char *filename = "test_canvas.raw";
+  set_new_image_flags(IMG_TILED);
+  ASSERT(init_image_mapped(&mapped, 70, 40, filename) == IMG_SUCCESS);
+  set_new_image_flags(0);
+  ASSERT(mapped.mapped_size == image_num_pixels(&mapped) * sizeof(uint32_t));
+  draw_pixel(&mapped, 65, 35, 0x123456FFU);
+  uint64_t index = image_pixel_index(&mapped, 65, 35);
+  free_image(&mapped);
+
+  FILE *in = fopen(filename, "rb");
+  ASSERT(in != NULL);
+  uint32_t pixel = 0;
+  ASSERT(fseek(in, (long) (index * sizeof(uint32_t)), SEEK_SET) == 0);
+  ASSERT(fread(&pixel, sizeof(uint32_t), 1, in) == 1);
+  fclose(in);
+  remove(filename);
+  ASSERT(pixel == 0x123456FFU);
+
+  // a file which can't be created
+  ASSERT(init_image_mapped(&mapped, 8, 8, "no_such_dir/canvas.raw") == IMG_ERR_COULD_NOT_OPEN);
+}
+
+void test_pixel_alloc(TestObjs *objs) {
+  (void) objs;
+  pixel_buffer_pool_release();
+
+  // small buffers are aligned for vector stores, large ones to a huge page
+  uint32_t *small = pixel_buffer_alloc(37);
+  uint64_t large_pixels = (PIXEL_HUGE_PAGE_SIZE / sizeof(uint32_t)) * 2 + 3;
+  uint32_t *large = pixel_buffer_alloc(large_pixels);
+  ASSERT(small != NULL && large != NULL);
+  ASSERT((uintptr_t) small % PIXEL_BUFFER_ALIGN == 0);
+  ASSERT((uintptr_t) large % PIXEL_HUGE_PAGE_SIZE == 0);
+
+  // fills starting and ending anywhere, small and large
+  for (uint32_t start = 0; start < 5; start++) {
+    for (uint32_t i = 0; i < 37; i++) {
+      small[i] = 0;
+    }
+    pixel_buffer_fill(small + start, 30, 0x12345678U);
+    for (uint32_t i = 0; i < 37; i++) {
+      ASSERT(small[i] == ((i >= start && i < start + 30) ? 0x12345678U : 0));
+    }
+  }
+  large[0] = 0;
+  large[large_pixels - 1] = 0;
+  pixel_buffer_fill(large + 1, large_pixels - 2, 0x000000FFU);
+  ASSERT(large[0] == 0 && large[large_pixels - 1] == 0);
+  for (uint64_t i = 1; i < large_pixels - 1; i++) {
+    ASSERT(large[i] == 0x000000FFU);
+  }
+
+  // freed buffers are reused for allocations of the same size only
+  pixel_buffer_free(large, large_pixels);
+  pixel_buffer_free(small, 37);
+  uint32_t *other = pixel_buffer_alloc(36);
+  ASSERT(other != small && other != large);
+  ASSERT(pixel_buffer_alloc(37) == small);
+  ASSERT(pixel_buffer_alloc(large_pixels) == large);
+
+  // so do images of the same size
+  struct Image img;
+  ASSERT(init_image(&img, 70, 40) == IMG_SUCCESS);
+  uint32_t *data = img.data;
+  ASSERT((uintptr_t) data % PIXEL_BUFFER_ALIGN == 0);
+  free_image(&img);
+  ASSERT(init_image(&img, 70, 40) == IMG_SUCCESS);
+  ASSERT(img.data == data);
+  ASSERT(img.data[0] == 0x000000FFU && img.data[70 * 40 - 1] == 0x000000FFU);
+  free_image(&img);
+
+  pixel_buffer_free(small, 37);
+  pixel_buffer_free(large, large_pixels);
+  pixel_buffer_free(other, 36);
+  pixel_buffer_pool_release();
+}
+
+void test_lazy_clear(TestObjs *objs) {
+  (void) objs;
+  const uint32_t layouts[] = { 0, IMG_TILED, IMG_PREMULTIPLIED };
+  for (unsigned l = 0; l < 3; l++) {
+    if ((layouts[l] & drawing_supported_flags()) != layouts[l]) {
+      continue;
+    }
+    set_new_image_flags(layouts[l]);
+    struct Image eager, lazy;
+    ASSERT(init_image(&eager, 70, 40) == IMG_SUCCESS);
+    set_new_image_lazy(1);
+    ASSERT(init_image(&lazy, 70, 40) == IMG_SUCCESS);
+    set_new_image_lazy(0);
+    set_new_image_flags(0);
+    ASSERT(image_enable_dirty_tracking(&lazy) == IMG_SUCCESS);
+
+    // fills of the whole image only change the uniform color
+    struct Rect whole = { .x = -3, .y = 0, .width = 80, .height = 40 };
+    ASSERT(image_fill_lazy(&lazy, 0, 0, 70, 40, 0x33669980U) == 1);
+    draw_rect(&eager, &whole, 0x33669980U);
+    draw_rect(&lazy, &whole, 0x11223340U);
+    draw_rect(&eager, &whole, 0x11223340U);
+    struct Rect dirty[4];
+    ASSERT(image_get_dirty_rects(&lazy, dirty, 4) == 1);
+    ASSERT(dirty[0].width == 70 && dirty[0].height == 40);
+
+    // until a tile is written, and then only if they are opaque
+    struct Rect part = { .x = 40, .y = 33, .width = 5, .height = 10 };
+    draw_pixel(&lazy, 3, 4, 0xFF000080U);
+    draw_pixel(&eager, 3, 4, 0xFF000080U);
+    ASSERT(image_fill_lazy(&lazy, 0, 0, 70, 40, 0x11223340U) == 0);
+    draw_rect(&lazy, &whole, 0x44556620U);
+    draw_rect(&eager, &whole, 0x44556620U);
+    draw_circle(&lazy, 60, 10, 8, 0x00FF0080U);
+    draw_circle(&eager, 60, 10, 8, 0x00FF0080U);
+    draw_rect(&lazy, &whole, 0x778899FFU);
+    draw_rect(&eager, &whole, 0x778899FFU);
+    draw_rect(&lazy, &part, 0x0000FFC0U);
+    draw_rect(&eager, &part, 0x0000FFC0U);
+
+    // unwritten tiles are encoded without being filled
+    ASSERT(write_image("test_lazy.png", &lazy) == IMG_SUCCESS);
+    struct Image decoded;
+    ASSERT(read_image("test_lazy.png", &decoded) == IMG_SUCCESS);
+    remove("test_lazy.png");
+
+    image_materialize(&lazy);
+    for (uint32_t j = 0; j < 40; j++) {
+      for (uint32_t i = 0; i < 70; i++) {
+        uint32_t pixel = eager.data[image_pixel_index(&eager, i, j)];
+        ASSERT(lazy.data[image_pixel_index(&lazy, i, j)] == pixel);
+        if (!(layouts[l] & IMG_PREMULTIPLIED)) {
+          ASSERT(decoded.data[j * 70 + i] == pixel);
+        }
+      }
+    }
+    free_image(&decoded);
+    free_image(&eager);
+    free_image(&lazy);
+  }
+}
+
+void test_png_streaming(TestObjs *objs) {
+  (void) objs;
+  // random pixels don't compress, so the image takes several IDAT chunks
+  uint32_t state = 777;
+  const uint32_t layouts[] = { 0, IMG_TILED };
+  for (unsigned l = 0; l < 2; l++) {
+    set_new_image_flags(layouts[l]);
+    struct Image img;
+    ASSERT(init_image(&img, 300, 200) == IMG_SUCCESS);
+    set_new_image_flags(0);
+    for (uint32_t j = 0; j < 200; j++) {
+      for (uint32_t i = 0; i < 300; i++) {
+        img.data[image_pixel_index(&img, i, j)] = test_rand(&state);
+      }
+    }
+
+    ASSERT(write_image("test_stream.png", &img) == IMG_SUCCESS);
+    struct Image decoded;
+    ASSERT(read_image("test_stream.png", &decoded) == IMG_SUCCESS);
+    ASSERT(decoded.width == 300 && decoded.height == 200);
+    for (uint32_t j = 0; j < 200; j++) {
+      for (uint32_t i = 0; i < 300; i++) {
+        ASSERT(decoded.data[j * 300 + i] == img.data[image_pixel_index(&img, i, j)]);
+      }
+    }
+    free_image(&decoded);
+
+    // a view is written row by row from its parent's pixels
+    struct Image view;
+    ASSERT(image_view(&view, &img, 32, 64, 100, 64) == IMG_SUCCESS);
+    ASSERT(write_image("test_stream.png", &view) == IMG_SUCCESS);
+    ASSERT(read_image("test_stream.png", &decoded) == IMG_SUCCESS);
+    ASSERT(decoded.width == 100 && decoded.height == 64);
+    for (uint32_t j = 0; j < 64; j++) {
+      for (uint32_t i = 0; i < 100; i++) {
+        ASSERT(decoded.data[j * 100 + i] == img.data[image_pixel_index(&img, 32 + i, 64 + j)]);
+      }
+    }
+    free_image(&decoded);
+    free_image(&img);
+  }
+
+  // RGB samples written with png_set_data are expanded to opaque pixels
+  uint8_t samples[9 * 5 * 3];
+  for (size_t i = 0; i < sizeof(samples); i++) {
+    samples[i] = (uint8_t) test_rand(&state);
+  }
+  png_t png;
+  ASSERT(png_open_file_write(&png, "test_stream.png") == PNG_NO_ERROR);
+  ASSERT(png_set_data(&png, 9, 5, 8, PNG_TRUECOLOR, samples) == PNG_NO_ERROR);
+  png_close_file(&png);
+  struct Image rgb;
+  ASSERT(read_image("test_stream.png", &rgb) == IMG_SUCCESS);
+  remove("test_stream.png");
+  for (size_t i = 0; i < 9 * 5; i++) {
+    ASSERT(rgb.data[i] == (((uint32_t) samples[i * 3] << 24) | ((uint32_t) samples[i * 3 + 1] << 16)
+                           | ((uint32_t) samples[i * 3 + 2] << 8) | 0xFFU));
+  }
+  free_image(&rgb);
+}